@@ -6,3 +6,6 @@ g++ -g -c -O2 -fPIC -lasound -pthread -o build/obj/plugin.o plugin.cpp
 g++ -shared -o build/bin/MIDIPlugin.so build/obj/plugin.o /usr/lib/x86_64-linux-gnu/libasound.so
 objcopy --only-keep-debug build/bin/MIDIPlugin.so build/bin/MIDIPlugin.debug
 strip --strip-debug build/bin/MIDIPlugin.so
+
+# loopback latency measurement tool
+g++ -O2 -DMIDI_LATENCY_TOOL -pthread -o build/bin/midi-latency plugin.cpp /usr/lib/x86_64-linux-gnu/libasound.so
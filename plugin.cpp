@@ -1,16 +1,45 @@
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
-#include <iterator>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <set>
-#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
+#include <climits>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <alsa/asoundlib.h>
 
+// UMP rawmidi and sequencer APIs appeared in alsa-lib 1.2.10
+#if SND_LIB_VERSION >= 0x01020a
+#include <alsa/ump.h>
+#define MIDI_UMP_SUPPORTED
+#endif
+
 typedef void ( *OnSendMessageDelegate )( const char*, const char* ) __attribute__((cdecl));
+typedef void ( *OnUmpPacketDelegate )( int, const unsigned int*, int ) __attribute__((cdecl));
+typedef void ( *OnMidiInputOverflowDelegate )( int, long long, long long ) __attribute__((cdecl));
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +51,216 @@ void InitializeMidiLinux();
 void TerminateMidiLinux();
 
 const char* GetDeviceNameLinux(const char* deviceId);
+int GetDeviceHandleLinux(const char* deviceId);
+
+// GetMidiDeviceList directions and capabilities
+#define MIDI_DIRECTION_INPUT      1
+#define MIDI_DIRECTION_OUTPUT     2
+#define MIDI_CAPABILITY_RAWMIDI   1
+#define MIDI_CAPABILITY_SEQUENCER 2
+#define MIDI_CAPABILITY_UMP       4
+#define MIDI_CAPABILITY_LOOPBACK  8
+#define MIDI_CAPABILITY_BROKER    16 // opened by the broker owner process
+
+int GetMidiDeviceList(unsigned char* buffer, int size);
+
+struct MidiFramePointers {
+    const long long* timestamps;
+    const int* handles;
+    const unsigned char* status;
+    const unsigned char* data1;
+    const unsigned char* data2;
+};
+
+void SetMidiFrameBufferEnabled(bool enabled);
+void SwapMidiFrame(MidiFramePointers* pointers, int* count);
+
+struct MidiMetrics {
+    long long frameDropped;
+    long long ioAllocations; // -1 unless built with MIDI_DEBUG_ALLOCATIONS
+    long long schedulingFallbacks; // threads that could not get the requested policy or affinity
+    long long inputDropped;  // events lost to full input queues, every device
+    long long inputResyncs;  // input streams resynchronized after lost bytes or read errors
+    long long captureDropped; // bytes the capture writer couldn't keep up with
+    long long brokerLost;     // broker input slots overwritten before this client read them
+    long long outputDropped;  // bytes a group writer thread couldn't keep up with
+    long long brokerSkipped;  // broker output reservations of dead or stuck clients, skipped by the owner
+    long long brokerDropped;  // broker output messages dropped by this client because the ring was full
+    long long mpeOverflows;   // MPE notes not tracked because MIDI_MPE_MAX_NOTES were sounding on the device
+};
+
+void GetMidiMetrics(MidiMetrics* metrics);
+
+// thread kinds for the scheduling APIs
+#define MIDI_THREAD_INPUT      0 // rawmidi and sequencer readers
+#define MIDI_THREAD_CONNECTION 1 // device scan
+#define MIDI_THREAD_SUBSCRIBER 2 // callback subscription workers
+#define MIDI_THREAD_DISPATCH   3 // input queue dispatcher, runs the message callback
+#define MIDI_THREAD_WRITER     4 // output group writers
+
+bool SetMidiThreadScheduling(int kind, int policy, int priority);
+bool SetMidiThreadAffinity(int kind, const int* cpus, int count);
+bool SetMidiMemoryLocked(bool locked);
+
+// span tracing of the I/O path into per-thread buffers, compiled out with -DMIDI_TRACE_DISABLED
+void SetMidiTraceEnabled(bool enabled);
+// writes the recorded spans as Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev open
+bool DumpMidiTrace(const char* path);
+void ClearMidiTrace();
+
+// one parsed message, system exclusive arrives as consecutive 0xf0 chunks of up to 8 bytes, the last one ends with 0xf7
+struct MidiEvent {
+    long long timestamp; // steady clock, nanoseconds
+    int handle;
+    unsigned char status;
+    unsigned char data1;
+    unsigned char data2;
+    unsigned char length; // bytes used in sysex
+    unsigned char sysex[8];
+};
+
+// MidiSubscriptionFilter message types, one bit per status
+#define MIDI_MESSAGE_NOTE_OFF          (1 << 0x8)
+#define MIDI_MESSAGE_NOTE_ON           (1 << 0x9)
+#define MIDI_MESSAGE_POLY_PRESSURE     (1 << 0xa)
+#define MIDI_MESSAGE_CONTROL_CHANGE    (1 << 0xb)
+#define MIDI_MESSAGE_PROGRAM_CHANGE    (1 << 0xc)
+#define MIDI_MESSAGE_CHANNEL_PRESSURE  (1 << 0xd)
+#define MIDI_MESSAGE_PITCH_WHEEL       (1 << 0xe)
+#define MIDI_MESSAGE_SYSTEM_EXCLUSIVE  (1 << 0x10)
+#define MIDI_MESSAGE_SYSTEM_COMMON     ((1 << 0x11) | (1 << 0x12) | (1 << 0x13) | (1 << 0x16))
+#define MIDI_MESSAGE_SYSTEM_REAL_TIME  ((1 << 0x18) | (1 << 0x1a) | (1 << 0x1b) | (1 << 0x1c) | (1 << 0x1e) | (1 << 0x1f))
+#define MIDI_MESSAGE_ALL               0xffffffff
+
+struct MidiSubscriptionFilter {
+    int handle;                // 0 for every device
+    unsigned int messageTypes; // MIDI_MESSAGE_*
+    unsigned short channels;   // bit per channel, 0xffff for all, system messages ignore it
+};
+
+// delivery modes
+#define MIDI_SUBSCRIPTION_CALLBACK 0 // called in batches on a worker thread of the subscription, while initialized
+#define MIDI_SUBSCRIPTION_RING     1 // polled with ReadMidiSubscription
+
+typedef void ( *OnMidiEventsDelegate )( int, const MidiEvent*, int ) __attribute__((cdecl));
+
+int SubscribeMidiEvents(const MidiSubscriptionFilter* filter, int mode, int capacity, OnMidiEventsDelegate callback);
+void UnsubscribeMidiEvents(int subscription);
+int ReadMidiSubscription(int subscription, MidiEvent* events, int maxCount);
+long long GetMidiSubscriptionDropped(int subscription);
+
+// input queue policies, applied when a device's queue is full
+#define MIDI_QUEUE_BLOCK       0 // the reader waits for room, nothing is lost
+#define MIDI_QUEUE_DROP_OLDEST 1
+#define MIDI_QUEUE_DROP_NEWEST 2
+#define MIDI_QUEUE_COALESCE    3 // controllers, pressure and pitch bend replace their queued value, others drop the oldest
+
+struct MidiInputQueueStats {
+    int capacity;
+    int policy;
+    int queued;
+    int highWater;
+    long long dropped;
+    long long coalesced;
+    long long resyncs;
+};
+
+// deviceId nullptr sets the default of devices attached later
+bool SetMidiInputQueue(const char* deviceId, int capacity, int policy);
+bool GetMidiInputQueueStats(const char* deviceId, MidiInputQueueStats* stats);
+// called on the dispatch thread with the device handle and its dropped and coalesced totals
+void SetMidiInputOverflowCallback(OnMidiInputOverflowDelegate callback);
+
+// rawmidi ("hw:") device parameters, latency against throughput
+#define MIDI_RAWMIDI_DEFAULT     0 // driver sized buffer, every write waits until the device has the bytes
+#define MIDI_RAWMIDI_LOW_LATENCY 1 // small buffer, readers wake on every byte, writes return once queued
+#define MIDI_RAWMIDI_BULK        2 // large buffer for sysex dumps, writes return once queued
+
+struct MidiRawmidiParams {
+    int bufferSize;      // bytes, 0 keeps the current size
+    int availMin;        // bytes available before a reader or writer wakes, 0 keeps the current value
+    int noActiveSensing; // 1: closing an output doesn't send active sensing
+    int drain;           // outputs: each write waits until the device has the bytes
+};
+
+// deviceId nullptr sets the default of devices attached later, otherwise the device is updated if attached
+// returns false if the driver refused the values, GetMidiRawmidiParams then tells what it kept
+bool SetMidiRawmidiProfile(const char* deviceId, int profile);
+bool SetMidiRawmidiParams(const char* deviceId, const MidiRawmidiParams* params);
+// the values in effect, direction is MIDI_DIRECTION_INPUT or MIDI_DIRECTION_OUTPUT
+bool GetMidiRawmidiParams(const char* deviceId, int direction, MidiRawmidiParams* params);
+
+// rawmidi inputs are read by count shard threads instead of a thread each, 0 for a thread per device
+// with shards the dispatcher merges the device queues, delivering what is queued in timestamp order
+// applied by the next InitializeMidiLinux
+bool SetMidiInputShards(int count);
+
+// in-process loopback device "loop:0", its output is parsed straight back as its input
+void SetMidiLoopbackEnabled(bool enabled);
+
+// round trip measurement, times in nanoseconds
+// histogram bin 0 counts values under 2us, bin i values in [2^i, 2^(i+1)) us
+#define MIDI_LATENCY_HISTOGRAM_BINS 24
+
+struct MidiLatencyReport {
+    int sent;
+    int received;
+    long long minimum;
+    long long median;
+    long long p99;
+    long long maximum;
+    long long jitter; // mean difference between consecutive round trips
+    int latencyHistogram[MIDI_LATENCY_HISTOGRAM_BINS];
+    int jitterHistogram[MIDI_LATENCY_HISTOGRAM_BINS];
+};
+
+// sends probeCount probes out of outputDeviceId and matches them on inputDeviceId, blocks until done
+// the ids may also be sequencer ports that aren't listed, e.g. Midi Through, and "seq:self" is the plugin's own port
+// a probe is timed when the reader parses it, before the input queue and the message callback; through the
+// loopback "loop:0" the write parses it right away, so that is a self-test of the probe path, not a latency figure
+bool RunMidiLatencyTest(const char* outputDeviceId, const char* inputDeviceId, int probeCount, int intervalMicros, int timeoutMillis, MidiLatencyReport* report);
+
+// records the received bytes of every input device, with their timestamps, until StopMidiCapture
+// bytes a reader can't stage, when the writer falls behind, are dropped and counted in captureDropped
+bool StartMidiCapture(const char* path);
+void StopMidiCapture();
+// feeds a capture through the parser and the dispatch path, speed 1 is real time, 0 unthrottled, blocks until done
+bool ReplayMidiCapture(const char* path, double speed);
+
+// MIDI Polyphonic Expression, zones come from the MPE Configuration Message (RPN 6) of each device
+// while enabled, pitch bend, CC74 and channel pressure of member channels update the per-note state
+// instead of being sent as OnMidiPitchWheel / OnMidiControlChange / OnMidiChannelAftertouch
+struct MidiMpeNote {
+    int handle;
+    unsigned char channel;
+    unsigned char note;
+    unsigned char velocity;
+    unsigned char releaseVelocity;
+    short pitchBend;              // -8192 to 8191
+    unsigned char pitchBendRange; // semitones
+    unsigned char timbre;         // CC74
+    unsigned char pressure;
+    unsigned char isActive;       // 0 once released, reported one last time
+};
+
+void SetMidiMpeEnabled(bool enabled);
+// notes changed since the previous call, call once per frame
+int GetMidiMpeNoteUpdates(MidiMpeNote* notes, int maxCount);
+// member channel counts, 0 when the zone is off
+bool GetMidiMpeZones(const char* deviceId, int* lowerMembers, int* upperMembers);
+
+// shared memory broker, so that several processes share the exclusive rawmidi and UMP devices
+// the owner opens them and publishes their input, clients see them as MIDI_CAPABILITY_BROKER devices
+// sequencer ports are shared by ALSA already, every process keeps using them directly
+#define MIDI_BROKER_OFF    0
+#define MIDI_BROKER_OWNER  1
+#define MIDI_BROKER_CLIENT 2
+#define MIDI_BROKER_AUTO   3 // owner if no other process is, client otherwise
+
+// applied by the next InitializeMidiLinux
+bool SetMidiBrokerMode(int mode);
+// MIDI_BROKER_OFF, MIDI_BROKER_OWNER or MIDI_BROKER_CLIENT
+int GetMidiBrokerRole();
 
 void SendMidiNoteOff(const char* deviceId, char channel, char note, char velocity);
 void SendMidiNoteOn(const char* deviceId, char channel, char note, char velocity);
@@ -42,21 +281,160 @@ void SendMidiStop(const char* deviceId);
 void SendMidiActiveSensing(const char* deviceId);
 void SendMidiReset(const char* deviceId);
 
+// named sets of outputs, a group send encodes the message once for all of them
+// members that aren't attached are skipped, and used as soon as they attach
+bool CreateMidiOutputGroup(const char* groupName, const char** deviceIds, int count);
+void DestroyMidiOutputGroup(const char* groupName);
+// parallel groups hand the rawmidi writes to a writer thread per device, so a slow device doesn't delay the others
+bool SetMidiOutputGroupParallel(const char* groupName, bool parallel);
+
+void SendMidiGroupNoteOff(const char* groupName, char channel, char note, char velocity);
+void SendMidiGroupNoteOn(const char* groupName, char channel, char note, char velocity);
+void SendMidiGroupPolyphonicAftertouch(const char* groupName, char channel, char note, char pressure);
+void SendMidiGroupControlChange(const char* groupName, char channel, char func, char value);
+void SendMidiGroupProgramChange(const char* groupName, char channel, char program);
+void SendMidiGroupChannelAftertouch(const char* groupName, char channel, char pressure);
+void SendMidiGroupPitchWheel(const char* groupName, char channel, short amount);
+void SendMidiGroupSystemExclusive(const char* groupName, unsigned char* data, int length);
+void SendMidiGroupTimeCodeQuarterFrame(const char* groupName, char value);
+void SendMidiGroupSongPositionPointer(const char* groupName, short position);
+void SendMidiGroupSongSelect(const char* groupName, char song);
+void SendMidiGroupTuneRequest(const char* groupName);
+void SendMidiGroupTimingClock(const char* groupName);
+void SendMidiGroupStart(const char* groupName);
+void SendMidiGroupContinue(const char* groupName);
+void SendMidiGroupStop(const char* groupName);
+void SendMidiGroupActiveSensing(const char* groupName);
+void SendMidiGroupReset(const char* groupName);
+
+// MIDI 2.0 Universal MIDI Packets, words in native byte order
+void SetUmpPacketCallback(OnUmpPacketDelegate callback);
+void SendUmpPacket(const char* deviceId, const unsigned int* words, int wordCount);
+
 #ifdef __cplusplus
 }
 #endif
 
-std::map<std::string, snd_rawmidi_t*> midiInputMap;
-std::map<std::string, snd_rawmidi_t*> midiOutputMap;
-std::map<std::string, snd_seq_addr_t> virtualMidiInputMap;
-std::map<std::string, snd_seq_addr_t> virtualMidiOutputMap;
-std::map<std::string, std::string> deviceNames;
+// input side of a rawmidi device, the handle is owned by its input thread
+struct MidiInputPort {
+    std::mutex mutex; // handle against parameter changes
+    snd_rawmidi_t* handle; // nullptr once closed
+#ifdef MIDI_UMP_SUPPORTED
+    snd_ump_t* ump; // UMP endpoints, instead of handle
+#endif
+    std::atomic<bool> closed;
+    MidiRawmidiParams params; // in effect
+};
+
+struct MidiLoopback;
+
+// output side of a rawmidi device, shared by every registry snapshot containing it
+struct MidiOutputPort {
+    std::mutex mutex;
+    snd_rawmidi_t* handle; // nullptr once closed
+#ifdef MIDI_UMP_SUPPORTED
+    snd_ump_t* ump; // UMP endpoints, instead of handle
+#endif
+    std::shared_ptr<MidiLoopback> loopback; // the in-process loopback, instead of handle
+    int brokerSlot; // 1 + index in the broker device table when the broker owner writes it, 0 otherwise
+    MidiRawmidiParams params; // in effect, params.drain waits after each write
+};
+
+struct MidiInputQueue;
+
+struct MidiDevice {
+    std::string id;
+    std::string name;
+    int handle;
+    int directions;   // MIDI_DIRECTION_*
+    int capabilities; // MIDI_CAPABILITY_*
+    std::shared_ptr<MidiInputPort> input;
+    std::shared_ptr<MidiOutputPort> output;
+    std::shared_ptr<MidiInputQueue> queue; // inputs only
+    snd_seq_addr_t address;
+};
+
+// grace periods for the copy-on-write snapshots
+// a thread uses a published snapshot inside a MidiReadSection, a writer retires the snapshot it replaced
+// and collectRetired frees it once every section that could have seen it has ended
+// sections are counted under two parities, the collector flips the parity and frees what was retired before
+// the previous flip when no section of that parity is left; neither readers nor the collector ever wait
+struct alignas(64) MidiReaderCount {
+    std::atomic<long> count;
+};
+
+std::atomic<unsigned int> readParity;
+MidiReaderCount readerCounts[2];
+
+struct MidiReadSection {
+    unsigned int parity;
+
+    MidiReadSection() {
+        while (true) {
+            parity = readParity.load();
+            readerCounts[parity].count.fetch_add(1);
+            if (readParity.load() == parity) {
+                break;
+            }
+            // flipped meanwhile, the collector may already be past its check of this parity
+            readerCounts[parity].count.fetch_sub(1);
+        }
+    }
+
+    ~MidiReadSection() {
+        readerCounts[parity].count.fetch_sub(1, std::memory_order_release);
+    }
+};
+
+std::mutex retiredMutex;
+std::vector<std::function<void()>> retiredBeforeFlip; // only sections of the previous parity can see these
+std::vector<std::function<void()>> retiredSinceFlip;
+
+void retireAfterGracePeriod(std::function<void()> free) {
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    retiredSinceFlip.push_back(std::move(free));
+}
+
+// frees what no section can see anymore, the rest waits for a later call
+void collectRetired() {
+    std::vector<std::function<void()>> freeable;
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        unsigned int parity = readParity.load();
+        if (readerCounts[1 - parity].count.load(std::memory_order_acquire) != 0) {
+            return;
+        }
+        freeable.swap(retiredBeforeFlip);
+        if (!retiredSinceFlip.empty()) {
+            retiredBeforeFlip.swap(retiredSinceFlip);
+            readParity.store(1 - parity);
+        }
+    }
+    // not under the lock, a snapshot's last reference may close queues and ports
+    for (std::vector<std::function<void()>>::iterator it = freeable.begin(); it != freeable.end(); ++it) {
+        (*it)();
+    }
+}
+
+// immutable snapshot of every attached device, readers never lock
+// a writer copies the published snapshot, applies its changes and publishes the copy
+// caches that outlive a read section hold a reference from pinDeviceRegistry
+struct MidiDeviceRegistry : std::enable_shared_from_this<MidiDeviceRegistry> {
+    // std::less<> allows lookup by const char* without building a std::string
+    std::map<std::string, MidiDevice, std::less<>> devices;
+};
+
+std::shared_ptr<MidiDeviceRegistry> publishedDeviceRegistry = std::make_shared<MidiDeviceRegistry>(); // owns the snapshot below
+std::atomic<const MidiDeviceRegistry*> deviceRegistry(publishedDeviceRegistry.get());
+std::mutex deviceRegistryWriterMutex;
+
+// stable for the process lifetime, so the managed side can keep them across detach / attach
+std::map<std::string, int, std::less<>> deviceHandles;
+std::mutex deviceHandlesMutex;
 
-std::mutex midiInputMapMutex;
-std::mutex midiOutputMapMutex;
-std::mutex virtualMidiInputMapMutex;
-std::mutex virtualMidiOutputMapMutex;
-std::mutex deviceNamesMutex;
+std::mutex sequencerOutputMutex;
+snd_midi_event_t* sequencerEncoder; // byte stream to sequencer events, guarded by sequencerOutputMutex
+#define MIDI_SEQUENCER_ENCODER_SIZE 256
 
 snd_seq_t *seq_handle = nullptr;
 int selfClientId;
@@ -65,363 +443,3835 @@ int selfPortNumber;
 const char *GAME_OBJECT_NAME = "MidiManager";
 
 volatile bool isStopped;
+bool isInitialized;
+std::mutex lifecycleMutex;
+
+// readable while stopping, wakes every poll() of the plugin threads
+// each thread keeps the descriptor of its own session, so a thread outliving TerminateMidiLinux still stops
+int wakeupFd = -1;
+
+#define MAX_POLL_DESCRIPTORS 8
+#define MIDI_THREAD_JOIN_TIMEOUT std::chrono::milliseconds(1000)
+
+struct MidiThread {
+    std::thread thread;
+    std::shared_ptr<std::atomic<bool>> finished;
+};
+
+// every plugin thread, joined by TerminateMidiLinux
+std::list<MidiThread> midiThreads;
+std::mutex midiThreadsMutex;
+std::condition_variable midiThreadsCondition;
+int runningThreads;
+
+template <typename Function, typename... Args>
+void startMidiThread(Function function, Args... args) {
+    std::lock_guard<std::mutex> lock(midiThreadsMutex);
+
+    // reap threads which already ended, e.g. inputs of detached devices
+    for (std::list<MidiThread>::iterator it = midiThreads.begin(); it != midiThreads.end();) {
+        if (it->finished->load()) {
+            it->thread.join();
+            it = midiThreads.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    std::shared_ptr<std::atomic<bool>> finished = std::make_shared<std::atomic<bool>>(false);
+    runningThreads++;
+    midiThreads.push_back(MidiThread());
+    midiThreads.back().finished = finished;
+    midiThreads.back().thread = std::thread([=]() {
+        function(args...);
+        {
+            std::lock_guard<std::mutex> lock(midiThreadsMutex);
+            runningThreads--;
+            midiThreadsCondition.notify_all();
+        }
+        finished->store(true);
+    });
+}
+
+// sleeps up to timeoutMillis, returns true when the session of stopFd is stopping
+bool sleepUntilStopped(int stopFd, int timeoutMillis) {
+    struct pollfd descriptor;
+    descriptor.fd = stopFd;
+    descriptor.events = POLLIN;
+    return poll(&descriptor, 1, timeoutMillis) > 0;
+}
+
+long long currentTimestamp();
+
+// span tracing
+// every thread records into its own ring, claimed from a pool the first time it traces, so recording never locks
+// or allocates; the pool is allocated when tracing is first enabled
+// a dump copies the rings while they are written, slots rewritten meanwhile are skipped like the broker input does
+// buffers of finished threads are kept until ClearMidiTrace, their spans are the interesting ones after a stall,
+// unless a new thread finds no unused buffer left
+#ifndef MIDI_TRACE_DISABLED
+#define MIDI_TRACE_EVENTS 16384
+#define MIDI_TRACE_BUFFERS 32
+
+// buffer states
+#define MIDI_TRACE_UNUSED   0
+#define MIDI_TRACE_OWNED    1
+#define MIDI_TRACE_FINISHED 2
+
+struct MidiTraceEvent {
+    std::atomic<unsigned long long> sequence; // position + 1 once written, 0 while written
+    const char* name;
+    long long start;
+    long long duration;
+    long long argument; // -1 for none
+};
+
+struct MidiTraceBuffer {
+    std::atomic<int> state; // MIDI_TRACE_*, changed under traceBuffersMutex except by the owner when it ends
+    int tid;
+    char threadName[16];
+    std::atomic<unsigned long long> head; // written by the owner thread only
+    std::atomic<unsigned long long> start; // positions before it were cleared
+    MidiTraceEvent events[MIDI_TRACE_EVENTS];
+};
+
+std::atomic<bool> traceEnabled;
+// MIDI_TRACE_BUFFERS of them, never freed since the threads keep pointers into it
+std::atomic<MidiTraceBuffer*> traceBuffers;
+std::mutex traceBuffersMutex; // claims, dumps and clears
+
+// marks the buffer of the thread when the thread ends
+struct MidiTraceThread {
+    MidiTraceBuffer* buffer;
+    ~MidiTraceThread() {
+        if (buffer != nullptr) {
+            buffer->state = MIDI_TRACE_FINISHED;
+        }
+    }
+};
+
+thread_local MidiTraceThread traceThread;
+
+// claims an unused buffer for the thread, else the one of a finished thread
+// nullptr while a dump holds the pool or when every buffer is owned, the span isn't recorded then
+MidiTraceBuffer* currentTraceBuffer() {
+    if (traceThread.buffer != nullptr) {
+        return traceThread.buffer;
+    }
+    MidiTraceBuffer* buffers = traceBuffers.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(traceBuffersMutex, std::try_to_lock);
+    if (buffers == nullptr || !lock.owns_lock()) {
+        return nullptr;
+    }
+
+    MidiTraceBuffer* buffer = nullptr;
+    for (int i = 0; i < MIDI_TRACE_BUFFERS && buffer == nullptr; i++) {
+        if (buffers[i].state == MIDI_TRACE_UNUSED) {
+            buffer = &buffers[i];
+        }
+    }
+    for (int i = 0; i < MIDI_TRACE_BUFFERS && buffer == nullptr; i++) {
+        if (buffers[i].state == MIDI_TRACE_FINISHED) {
+            buffer = &buffers[i];
+        }
+    }
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+    buffer->start = buffer->head.load();
+    buffer->tid = syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), buffer->threadName, sizeof(buffer->threadName));
+    buffer->state = MIDI_TRACE_OWNED;
+    traceThread.buffer = buffer;
+    return buffer;
+}
+
+void recordTraceSpan(const char* name, long long start, long long end, long long argument) {
+    MidiTraceBuffer* buffer = currentTraceBuffer();
+    if (buffer == nullptr) {
+        return;
+    }
+    unsigned long long position = buffer->head.load(std::memory_order_relaxed);
+    MidiTraceEvent& event = buffer->events[position % MIDI_TRACE_EVENTS];
+    event.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name = name;
+    event.start = start;
+    event.duration = end - start;
+    event.argument = argument;
+    event.sequence.store(position + 1, std::memory_order_release);
+    buffer->head.store(position + 1, std::memory_order_release);
+}
+
+// times its scope, a single relaxed load when tracing is off
+struct MidiTraceSpan {
+    const char* name;
+    long long start;
+    long long argument;
+
+    explicit MidiTraceSpan(const char* spanName) : name(spanName), start(0), argument(-1) {
+        if (traceEnabled.load(std::memory_order_relaxed)) {
+            start = currentTimestamp();
+        }
+    }
+    ~MidiTraceSpan() {
+        end();
+    }
+    void end() {
+        if (start != 0) {
+            recordTraceSpan(name, start, currentTimestamp(), argument);
+            start = 0;
+        }
+    }
+};
+
+#define MIDI_TRACE_SPAN(name) MidiTraceSpan traceSpan(name)
+#define MIDI_TRACE_ARGUMENT(value) (traceSpan.argument = (value))
+#define MIDI_TRACE_END() traceSpan.end()
+#else
+#define MIDI_TRACE_SPAN(name)
+#define MIDI_TRACE_ARGUMENT(value)
+#define MIDI_TRACE_END()
+#endif
 
 OnSendMessageDelegate onSendMessage;
 
 void UnitySendMessage(const char* obj, const char* method, const char* msg) {
     if (onSendMessage) {
+        MIDI_TRACE_SPAN("callback");
         onSendMessage(method, msg);
     }
 }
 
-void virtualMidiEventWatcher() {
-    snd_seq_event_t *ev = nullptr;
-    char deviceId[32];
-    char eventMessage[128];
+int nextDeviceHandle = 1;
 
-    while (!isStopped && seq_handle != nullptr) {
-        snd_seq_event_input(seq_handle, &ev);
+// stable small integer for the deviceId, assigned on first use
+int assignDeviceHandle(const char* deviceId) {
+    std::lock_guard<std::mutex> lock(deviceHandlesMutex);
+    decltype(deviceHandles)::iterator it = deviceHandles.find(deviceId);
+    if (it != deviceHandles.end()) {
+        return it->second;
+    }
+    int handle = nextDeviceHandle++;
+    deviceHandles.insert(std::make_pair(deviceId, handle));
+    return handle;
+}
+
+#ifdef MIDI_DEBUG_ALLOCATIONS
+// counts heap allocations made by the I/O threads, to verify the steady state is allocation free
+std::atomic<long long> ioAllocations;
+thread_local bool isIoThread;
+
+void* operator new(std::size_t size) {
+    if (isIoThread) {
+        ioAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    free(p);
+}
+#endif
+
+// preallocated scratch memory owned by one I/O thread
+// the buffers only grow when a message larger than any seen before arrives, so the steady state doesn't touch malloc
+#define IO_ARENA_SYSEX_RESERVE 4096
+
+struct IoArena {
+    std::vector<unsigned char> systemExclusiveStream;
+    std::vector<char> eventMessage;
+
+    void reserve() {
+        systemExclusiveStream.reserve(IO_ARENA_SYSEX_RESERVE);
+        // "255," per byte plus the device id prefix
+        eventMessage.resize(IO_ARENA_SYSEX_RESERVE * 4 + 64);
+    }
+};
+
+thread_local IoArena ioArena;
+
+// called at the top of every I/O thread, before its loop
+void ioThreadStarted() {
+#ifdef MIDI_DEBUG_ALLOCATIONS
+    isIoThread = true;
+#endif
+    ioArena.reserve();
+}
+
+// decimal text of every 14 bit value, so the formatters never divide per digit
+struct MidiDecimal {
+    char text[5];
+    unsigned char length;
+};
+
+struct MidiDecimalTable {
+    MidiDecimal values[16384];
+};
+
+constexpr MidiDecimalTable makeDecimalTable() {
+    MidiDecimalTable table = {};
+    for (int value = 0; value < 16384; value++) {
+        int length = value >= 10000 ? 5 : value >= 1000 ? 4 : value >= 100 ? 3 : value >= 10 ? 2 : 1;
+        int rest = value;
+        for (int i = length - 1; i >= 0; i--) {
+            table.values[value].text[i] = '0' + rest % 10;
+            rest /= 10;
+        }
+        table.values[value].length = length;
+    }
+    return table;
+}
+
+constexpr MidiDecimalTable DECIMALS = makeDecimalTable();
+
+// appends the decimal text of the value, returns the new end, needs 5 bytes of room (11 outside 0-16383)
+inline char* appendDecimal(char* out, int value) {
+    if (value < 0 || value >= 16384) {
+        return out + sprintf(out, "%d", value);
+    }
+    const MidiDecimal& decimal = DECIMALS.values[value];
+    memcpy(out, decimal.text, sizeof(decimal.text));
+    return out + decimal.length;
+}
+
+// formats "deviceId,0,b0,b1,...,bn" into the thread's arena, the prefix is the queue's "deviceId,0,"
+// trailingSeparator appends a ',' after the last byte too, as the sequencer path always did
+const char* formatSystemExclusive(const std::string& prefix, const unsigned char* data, size_t length, bool trailingSeparator) {
+    // the last value writes its whole table entry before the terminator
+    size_t required = prefix.size() + length * 4 + 5;
+    if (ioArena.eventMessage.size() < required) {
+        ioArena.eventMessage.resize(required);
+    }
+
+    char* out = ioArena.eventMessage.data();
+    memcpy(out, prefix.data(), prefix.size());
+    out += prefix.size();
+    for (size_t i = 0; i < length; i++) {
+        out = appendDecimal(out, data[i]);
+        if (i + 1 < length || trailingSeparator) {
+            *out++ = ',';
+        }
+    }
+    *out = '\0';
+
+    return ioArena.eventMessage.data();
+}
+
+#define MIDI_THREAD_KIND_COUNT 5
+
+struct MidiThreadConfig {
+    int policy;
+    int priority;
+    bool hasAffinity;
+    cpu_set_t cpus;
+};
+
+// applied by each thread when it starts, so set these before InitializeMidiLinux
+MidiThreadConfig threadConfigs[MIDI_THREAD_KIND_COUNT];
+std::mutex threadConfigsMutex;
+std::atomic<long long> schedulingFallbacks;
+
+// applies the scheduling settings of the kind to the calling thread, and names it for perf / top
+// the kernel keeps 15 characters of the name, device threads are "mi <id>" and "mo <id>" to fit the id
+void configureCurrentThread(int kind, const char* name) {
+    char threadName[16];
+    snprintf(threadName, sizeof(threadName), "%s", name);
+    pthread_setname_np(pthread_self(), threadName);
+
+    MidiThreadConfig config;
+    {
+        std::lock_guard<std::mutex> lock(threadConfigsMutex);
+        config = threadConfigs[kind];
+    }
+
+    if (config.policy == SCHED_FIFO || config.policy == SCHED_RR) {
+        sched_param param;
+        param.sched_priority = config.priority;
+        int result = pthread_setschedparam(pthread_self(), config.policy, &param);
+        if (result == EPERM) {
+            // without CAP_SYS_NICE, retry within RLIMIT_RTPRIO
+            rlimit limit;
+            if (getrlimit(RLIMIT_RTPRIO, &limit) == 0 && limit.rlim_cur > 0 && (int)limit.rlim_cur < config.priority) {
+                param.sched_priority = limit.rlim_cur;
+                result = pthread_setschedparam(pthread_self(), config.policy, &param);
+            }
+        }
+        if (result != 0) {
+            // keep running at default priority
+            schedulingFallbacks++;
+        }
+    }
+
+    if (config.hasAffinity) {
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &config.cpus) != 0) {
+            schedulingFallbacks++;
+        }
+    }
+}
+
+// the result is valid while the caller is in a MidiReadSection, or on the connection thread, the only writer
+const MidiDevice* findMidiDevice(const char* deviceId, int direction) {
+    const MidiDeviceRegistry* registry = deviceRegistry.load(std::memory_order_acquire);
+    decltype(registry->devices)::const_iterator it = registry->devices.find(deviceId);
+    if (it == registry->devices.end() || !(it->second.directions & direction)) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+// copy-on-write: the first change of a scan copies the published snapshot
+// caller holds deviceRegistryWriterMutex
+MidiDevice& editMidiDevice(const MidiDeviceRegistry* current, MidiDeviceRegistry*& next, const char* deviceId, const char* deviceName) {
+    if (next == nullptr) {
+        next = new MidiDeviceRegistry(*current);
+    }
+
+    decltype(next->devices)::iterator it = next->devices.find(deviceId);
+    if (it == next->devices.end()) {
+        MidiDevice device;
+        device.id = deviceId;
+        device.name = deviceName != nullptr ? deviceName : "";
+        device.handle = assignDeviceHandle(deviceId);
+        device.directions = 0;
+        device.capabilities = 0;
+        device.address.client = 0;
+        device.address.port = 0;
+        it = next->devices.insert(std::make_pair(device.id, device)).first;
+    }
+    return it->second;
+}
+
+// caller holds deviceRegistryWriterMutex
+void publishDeviceRegistry(MidiDeviceRegistry* registry) {
+    std::shared_ptr<MidiDeviceRegistry> previous = publishedDeviceRegistry;
+    publishedDeviceRegistry.reset(registry);
+    deviceRegistry.store(registry, std::memory_order_release);
+    // readers may still be in the replaced snapshot, the reference is dropped after their sections
+    retireAfterGracePeriod([previous]() mutable { previous.reset(); });
+}
+
+// a reference to the published snapshot, for caches that are used outside a read section
+std::shared_ptr<const MidiDeviceRegistry> pinDeviceRegistry() {
+    MidiReadSection section;
+    return deviceRegistry.load(std::memory_order_acquire)->shared_from_this();
+}
+
+void closeMidiOutputPort(MidiOutputPort* port) {
+    std::lock_guard<std::mutex> lock(port->mutex);
+    if (port->handle != nullptr) {
+        snd_rawmidi_close(port->handle);
+        port->handle = nullptr;
+    }
+#ifdef MIDI_UMP_SUPPORTED
+    if (port->ump != nullptr) {
+        snd_ump_close(port->ump);
+        port->ump = nullptr;
+    }
+#endif
+    port->loopback.reset();
+    port->brokerSlot = 0;
+}
+
+// rawmidi parameters, per device id
+MidiRawmidiParams rawmidiProfiles[] = {
+    {0, 1, 1, 1},     // MIDI_RAWMIDI_DEFAULT, the driver's buffer size, the kernel's defaults and SND_RAWMIDI_SYNC writes
+    {256, 1, 1, 0},   // MIDI_RAWMIDI_LOW_LATENCY
+    {65536, 1, 1, 0}, // MIDI_RAWMIDI_BULK
+};
+MidiRawmidiParams defaultRawmidiParams = rawmidiProfiles[MIDI_RAWMIDI_DEFAULT];
+std::map<std::string, MidiRawmidiParams, std::less<>> rawmidiParamsConfigs;
+std::mutex rawmidiParamsConfigsMutex;
+
+MidiRawmidiParams configuredRawmidiParams(const char* deviceId) {
+    std::lock_guard<std::mutex> lock(rawmidiParamsConfigsMutex);
+    decltype(rawmidiParamsConfigs)::iterator it = rawmidiParamsConfigs.find(deviceId);
+    return it != rawmidiParamsConfigs.end() ? it->second : defaultRawmidiParams;
+}
+
+// returns false if the driver refused, effective gets what it has either way
+bool applyRawmidiParams(snd_rawmidi_t* handle, const MidiRawmidiParams& requested, MidiRawmidiParams* effective) {
+    snd_rawmidi_params_t* params;
+    snd_rawmidi_params_alloca(&params);
+    bool applied = snd_rawmidi_params_current(handle, params) >= 0;
+    if (applied) {
+        if (requested.bufferSize > 0) {
+            applied = snd_rawmidi_params_set_buffer_size(handle, params, requested.bufferSize) >= 0 && applied;
+        }
+        if (requested.availMin > 0) {
+            applied = snd_rawmidi_params_set_avail_min(handle, params, requested.availMin) >= 0 && applied;
+        }
+        applied = snd_rawmidi_params_set_no_active_sensing(handle, params, requested.noActiveSensing) >= 0 && applied;
+        applied = snd_rawmidi_params(handle, params) >= 0 && applied;
+    }
+    if (snd_rawmidi_params_current(handle, params) >= 0) {
+        effective->bufferSize = snd_rawmidi_params_get_buffer_size(params);
+        effective->availMin = snd_rawmidi_params_get_avail_min(params);
+        effective->noActiveSensing = snd_rawmidi_params_get_no_active_sensing(params);
+    }
+    effective->drain = requested.drain;
+    return applied;
+}
+
+void writeUmpOutput(MidiOutputPort* port, const unsigned char* data, size_t length);
+void writeLoopback(MidiLoopback* loopback, const unsigned char* data, size_t length);
+void writeBrokerOutput(int index, const unsigned char* data, size_t length);
+
+// rawmidi write, serialized per device, writeMidiOutput also keeps the order with the device's writer thread
+void writeMidiOutputPort(const MidiDevice* device, const void* data, size_t length) {
+    MIDI_TRACE_SPAN("send");
+    MIDI_TRACE_ARGUMENT(length);
+    std::lock_guard<std::mutex> lock(device->output->mutex);
+    if (device->output->handle != nullptr) {
+        snd_rawmidi_write(device->output->handle, data, length);
+        if (device->output->params.drain) {
+            snd_rawmidi_drain(device->output->handle);
+        }
+    }
+#ifdef MIDI_UMP_SUPPORTED
+    if (device->output->ump != nullptr) {
+        writeUmpOutput(device->output.get(), (const unsigned char*)data, length);
+    }
+#endif
+    if (device->output->loopback) {
+        writeLoopback(device->output->loopback.get(), (const unsigned char*)data, length);
+    }
+    if (device->output->brokerSlot > 0) {
+        writeBrokerOutput(device->output->brokerSlot - 1, (const unsigned char*)data, length);
+    }
+}
+
+// sends ev, already holding the message, directly to the sequencer port of the device
+void outputSequencerEvent(const MidiDevice* device, snd_seq_event_t* ev) {
+    MIDI_TRACE_SPAN("send");
+    std::lock_guard<std::mutex> lock(sequencerOutputMutex);
+    if (seq_handle == nullptr) {
+        return;
+    }
+
+    snd_seq_ev_set_direct(ev);
+    snd_seq_ev_set_dest(ev, device->address.client, device->address.port);
+    snd_seq_event_output(seq_handle, ev);
+    snd_seq_drain_output(seq_handle);
+}
+
+// encodes a MIDI 1.0 byte stream into sequencer events for the device
+void outputSequencerBytes(const MidiDevice* device, const unsigned char* data, size_t length) {
+    MIDI_TRACE_SPAN("send");
+    MIDI_TRACE_ARGUMENT(length);
+    std::lock_guard<std::mutex> lock(sequencerOutputMutex);
+    if (seq_handle == nullptr) {
+        return;
+    }
+    if (sequencerEncoder == nullptr && snd_midi_event_new(MIDI_SEQUENCER_ENCODER_SIZE, &sequencerEncoder) < 0) {
+        return;
+    }
+
+    while (length > 0) {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        long consumed = snd_midi_event_encode(sequencerEncoder, data, length, &ev);
+        if (consumed <= 0) {
+            break;
+        }
+        data += consumed;
+        length -= consumed;
+
+        if (ev.type != SND_SEQ_EVENT_NONE) {
+            snd_seq_ev_set_direct(&ev);
+            snd_seq_ev_set_dest(&ev, device->address.client, device->address.port);
+            snd_seq_event_output(seq_handle, &ev);
+        }
+    }
+    snd_seq_drain_output(seq_handle);
+}
+
+// output groups
+// a group caches its members' registry entries per snapshot, so a send doesn't look up the ids
+// sequencer members share one encoding and one drain, the other members one buffer of bytes
+#define MIDI_WRITER_MAX_PENDING 65536
+
+// writer thread of a device, for parallel groups
+struct MidiOutputWriter {
+    std::string deviceId;
+    int fd; // eventfd, signaled when pending gets bytes
+    std::mutex mutex;
+    std::vector<unsigned char> pending;
+    std::mutex writeMutex; // held while writing to the device, by the writer thread or a direct write going after pending
+    std::vector<unsigned char> writing;
+    std::atomic<bool> stopped; // no parallel group uses the device anymore, the thread ends once pending is written
+
+    ~MidiOutputWriter() {
+        close(fd);
+    }
+};
+
+struct MidiOutputGroup {
+    std::mutex mutex; // a send at a time, in order
+    std::vector<std::string> deviceIds;
+    bool parallel;
+    std::shared_ptr<const MidiDeviceRegistry> resolved; // the snapshot the members below point into, empty to resolve again
+    std::vector<const MidiDevice*> outputs; // rawmidi, UMP, loopback and broker outputs
+    std::vector<std::shared_ptr<MidiOutputWriter>> writers; // parallel groups, same order as outputs
+    std::vector<const MidiDevice*> sequencerPorts;
+};
+
+std::map<std::string, std::shared_ptr<MidiOutputGroup>, std::less<>> outputGroups;
+std::mutex outputGroupsMutex;
+// shared by the groups, so the writes to a device keep their order
+std::map<std::string, std::shared_ptr<MidiOutputWriter>, std::less<>> outputWriters;
+std::mutex outputWritersMutex;
+std::atomic<int> outputWriterCount; // direct writes look for a writer only when there are some
+std::atomic<long long> outputDropped;
+
+// writes what was queued for the writer so far, caller holds writer->writeMutex
+void drainOutputWriter(MidiOutputWriter* writer, const MidiDevice* device) {
+    {
+        std::lock_guard<std::mutex> lock(writer->mutex);
+        writer->writing.swap(writer->pending);
+    }
+    if (!writer->writing.empty()) {
+        if (device != nullptr && device->output) {
+            writeMidiOutputPort(device, writer->writing.data(), writer->writing.size());
+        }
+        writer->writing.clear();
+    }
+}
+
+void midiOutputWriter(std::shared_ptr<MidiOutputWriter> writer) {
+    char threadName[32];
+    sprintf(threadName, "mo %s", writer->deviceId.c_str());
+    configureCurrentThread(MIDI_THREAD_WRITER, threadName);
+    ioThreadStarted();
+
+    struct pollfd descriptors[2];
+    descriptors[0].fd = writer->fd;
+    descriptors[0].events = POLLIN;
+    descriptors[1].fd = wakeupFd;
+    descriptors[1].events = POLLIN;
+
+    while (!isStopped) {
+        if (poll(descriptors, 2, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (isStopped || descriptors[1].revents) {
+            break;
+        }
+        uint64_t value;
+        read(writer->fd, &value, sizeof(value));
+
+        MidiReadSection section;
+        const MidiDevice* device = findMidiDevice(writer->deviceId.c_str(), MIDI_DIRECTION_OUTPUT);
+        std::lock_guard<std::mutex> lock(writer->writeMutex);
+        drainOutputWriter(writer.get(), device);
+        if (writer->stopped) {
+            break;
+        }
+    }
+}
+
+// the writer of the device, started if the plugin runs, caller holds lifecycleMutex
+std::shared_ptr<MidiOutputWriter> openOutputWriter(const std::string& deviceId) {
+    std::lock_guard<std::mutex> lock(outputWritersMutex);
+    decltype(outputWriters)::iterator it = outputWriters.find(deviceId);
+    if (it != outputWriters.end()) {
+        return it->second;
+    }
+    if (!isInitialized) {
+        return nullptr;
+    }
+    std::shared_ptr<MidiOutputWriter> writer = std::make_shared<MidiOutputWriter>();
+    writer->deviceId = deviceId;
+    writer->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    writer->stopped = false;
+    writer->pending.reserve(MIDI_WRITER_MAX_PENDING);
+    writer->writing.reserve(MIDI_WRITER_MAX_PENDING);
+    outputWriters.insert(std::make_pair(deviceId, writer));
+    outputWriterCount++;
+    startMidiThread(midiOutputWriter, writer);
+    return writer;
+}
+
+// the writers of every parallel group, caller holds lifecycleMutex
+void openGroupWriters(MidiOutputGroup* group) {
+    if (!group->parallel) {
+        return;
+    }
+    for (std::vector<std::string>::iterator it = group->deviceIds.begin(); it != group->deviceIds.end(); ++it) {
+        openOutputWriter(*it);
+    }
+}
+
+// stops the writers no parallel group uses anymore, caller holds lifecycleMutex and outputGroupsMutex
+void closeUnusedOutputWriters() {
+    std::set<std::string> used;
+    for (decltype(outputGroups)::iterator it = outputGroups.begin(); it != outputGroups.end(); ++it) {
+        if (it->second->parallel) {
+            used.insert(it->second->deviceIds.begin(), it->second->deviceIds.end());
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(outputWritersMutex);
+    for (decltype(outputWriters)::iterator it = outputWriters.begin(); it != outputWriters.end();) {
+        if (used.count(it->first) != 0) {
+            ++it;
+            continue;
+        }
+        it->second->stopped = true;
+        uint64_t value = 1;
+        write(it->second->fd, &value, sizeof(value));
+        it = outputWriters.erase(it);
+        outputWriterCount--;
+    }
+}
+
+void queueOutputWriter(MidiOutputWriter* writer, const unsigned char* data, size_t length) {
+    {
+        std::lock_guard<std::mutex> lock(writer->mutex);
+        if (writer->pending.size() + length > MIDI_WRITER_MAX_PENDING) {
+            outputDropped += length;
+            return;
+        }
+        writer->pending.insert(writer->pending.end(), data, data + length);
+    }
+    uint64_t value = 1;
+    write(writer->fd, &value, sizeof(value));
+}
+
+// while the device has a writer thread, a direct write first writes what the groups queued for it
+// and holds the writer meanwhile, so the device gets the messages in the order they were sent
+struct MidiOutputWriterFlush {
+    std::shared_ptr<MidiOutputWriter> writer;
 
-        sprintf(deviceId, "seq:%d-%d", ev->data.addr.client, ev->data.addr.port);
+    MidiOutputWriterFlush(const MidiDevice* device) {
+        if (outputWriterCount.load(std::memory_order_acquire) == 0) {
+            return;
+        }
         {
-            std::lock_guard<std::mutex> lock(virtualMidiInputMapMutex);
-            if (virtualMidiInputMap.find(deviceId) == virtualMidiInputMap.end()) {
-                // ignore if not connected
-                continue;
+            std::lock_guard<std::mutex> lock(outputWritersMutex);
+            decltype(outputWriters)::iterator it = outputWriters.find(device->id);
+            if (it == outputWriters.end()) {
+                return;
             }
+            writer = it->second;
         }
+        writer->writeMutex.lock();
+        drainOutputWriter(writer.get(), device);
+    }
 
-        // https://www.alsa-project.org/alsa-doc/alsa-lib/group___seq_events.html#gaef39e1f267006faf7abc91c3cb32ea40
-        switch (ev->type) {
-            case SND_SEQ_EVENT_NOTEON:
-                sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, ev->data.note.channel, ev->data.note.note, ev->data.note.velocity);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiNoteOn", eventMessage);
-                break;
-            case SND_SEQ_EVENT_NOTEOFF:
-                sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, ev->data.note.channel, ev->data.note.note, ev->data.note.velocity);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiNoteOff", eventMessage);
-                break;
-            case SND_SEQ_EVENT_CONTROLLER:
-                sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, ev->data.control.channel, ev->data.control.param, ev->data.control.value);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiControlChange", eventMessage);
-                break;
-            case SND_SEQ_EVENT_PGMCHANGE:
-                sprintf(eventMessage, "%s,0,%d,%d", deviceId, ev->data.control.channel, ev->data.control.value);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiProgramChange", eventMessage);
-                break;
-            case SND_SEQ_EVENT_CHANPRESS:
-                sprintf(eventMessage, "%s,0,%d,%d", deviceId, ev->data.control.channel, ev->data.control.value);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiChannelAftertouch", eventMessage);
-                break;
-            case SND_SEQ_EVENT_KEYPRESS:
-                sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, ev->data.note.channel, ev->data.note.note, ev->data.note.velocity);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiPolyphonicAftertouch", eventMessage);
-                break;
-            case SND_SEQ_EVENT_PITCHBEND:
-                sprintf(eventMessage, "%s,0,%d,%d", deviceId, ev->data.control.channel, ev->data.control.value + 8192);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiPitchWheel", eventMessage);
-                break;
-            case SND_SEQ_EVENT_SYSEX:
-                {
-                    std::vector<unsigned char> systemExclusiveStream;
-                    for (int i = 0; i < ev->data.ext.len; ++i) {
-                        systemExclusiveStream.push_back(((unsigned char *)(ev->data.ext.ptr))[i]);
-                    }
-                    std::ostringstream oss;
-                    oss << deviceId;
-                    oss << ",0,";
-                    std::copy(systemExclusiveStream.begin(), systemExclusiveStream.end(), std::ostream_iterator<int>(oss, ","));
-                    systemExclusiveStream.clear();
+    ~MidiOutputWriterFlush() {
+        if (writer) {
+            writer->writeMutex.unlock();
+        }
+    }
+};
 
-                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSystemExclusive", oss.str().c_str());
-                }
-                break;
-            case SND_SEQ_EVENT_SONGPOS:
-                sprintf(eventMessage, "%s,0,%d", deviceId, ev->data.control.value);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSongPositionPointer", eventMessage);
-                break;
-            case SND_SEQ_EVENT_SONGSEL:
-                sprintf(eventMessage, "%s,0,%d", deviceId, ev->data.control.value);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSongSelect", eventMessage);
-                break;
-            case SND_SEQ_EVENT_QFRAME:
-                sprintf(eventMessage, "%s,0,%d", deviceId, ev->data.control.value);
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiTimeCodeQuarterFrame", eventMessage);
-                break;
-            case SND_SEQ_EVENT_TUNE_REQUEST:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiTuneRequest", deviceId);
-                break;
-            case SND_SEQ_EVENT_CLOCK:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiTimingClock", deviceId);
-                break;
-            case SND_SEQ_EVENT_START:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiStart", deviceId);
-                break;
-            case SND_SEQ_EVENT_CONTINUE:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiContinue", deviceId);
-                break;
-            case SND_SEQ_EVENT_STOP:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiStop", deviceId);
-                break;
-            case SND_SEQ_EVENT_SENSING:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiActiveSensing", deviceId);
-                break;
-            case SND_SEQ_EVENT_RESET:
-                UnitySendMessage(GAME_OBJECT_NAME, "OnMidiReset", deviceId);
-                break;
+void writeMidiOutput(const MidiDevice* device, const void* data, size_t length) {
+    MidiOutputWriterFlush flush(device);
+    writeMidiOutputPort(device, data, length);
+}
+
+// caller holds group->mutex
+void resolveOutputGroup(MidiOutputGroup* group) {
+    // the group's reference keeps the snapshot alive, so an equal address is the same snapshot
+    if (group->resolved && group->resolved.get() == deviceRegistry.load(std::memory_order_acquire)) {
+        return;
+    }
+    group->resolved = pinDeviceRegistry();
+    const MidiDeviceRegistry* registry = group->resolved.get();
+    group->outputs.clear();
+    group->writers.clear();
+    group->sequencerPorts.clear();
+    for (std::vector<std::string>::iterator it = group->deviceIds.begin(); it != group->deviceIds.end(); ++it) {
+        decltype(registry->devices)::const_iterator device = registry->devices.find(*it);
+        if (device == registry->devices.end() || !(device->second.directions & MIDI_DIRECTION_OUTPUT)) {
+            continue;
+        }
+        if (!device->second.output) {
+            group->sequencerPorts.push_back(&device->second);
+            continue;
+        }
+        group->outputs.push_back(&device->second);
+        if (group->parallel) {
+            std::lock_guard<std::mutex> lock(outputWritersMutex);
+            decltype(outputWriters)::iterator writer = outputWriters.find(*it);
+            group->writers.push_back(writer != outputWriters.end() ? writer->second : nullptr);
         }
     }
 }
 
-void midiEventWatcher(std::string deviceIdStr, snd_rawmidi_t* midiInput) {
-    using namespace std::chrono_literals;
-    ssize_t read;
-    unsigned char buffer[1024];
+// encodes once, then outputs each event to every port and drains once
+void outputSequencerGroup(const std::vector<const MidiDevice*>& ports, const unsigned char* data, size_t length) {
+    MIDI_TRACE_SPAN("send");
+    MIDI_TRACE_ARGUMENT(length);
+    std::lock_guard<std::mutex> lock(sequencerOutputMutex);
+    if (seq_handle == nullptr) {
+        return;
+    }
+
+    if (data[0] == 0xf0) {
+        // a whole sysex message, like SendMidiSystemExclusive sends it
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_sysex(&ev, length, (void*)data);
+        snd_seq_ev_set_direct(&ev);
+        for (std::vector<const MidiDevice*>::const_iterator it = ports.begin(); it != ports.end(); ++it) {
+            snd_seq_ev_set_dest(&ev, (*it)->address.client, (*it)->address.port);
+            snd_seq_event_output(seq_handle, &ev);
+        }
+        snd_seq_drain_output(seq_handle);
+        return;
+    }
+
+    if (sequencerEncoder == nullptr && snd_midi_event_new(MIDI_SEQUENCER_ENCODER_SIZE, &sequencerEncoder) < 0) {
+        return;
+    }
+    while (length > 0) {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        long consumed = snd_midi_event_encode(sequencerEncoder, data, length, &ev);
+        if (consumed <= 0) {
+            break;
+        }
+        data += consumed;
+        length -= consumed;
+
+        if (ev.type != SND_SEQ_EVENT_NONE) {
+            snd_seq_ev_set_direct(&ev);
+            for (std::vector<const MidiDevice*>::const_iterator it = ports.begin(); it != ports.end(); ++it) {
+                snd_seq_ev_set_dest(&ev, (*it)->address.client, (*it)->address.port);
+                snd_seq_event_output(seq_handle, &ev);
+            }
+        }
+    }
+    snd_seq_drain_output(seq_handle);
+}
+
+void sendGroupMessage(const char* groupName, const unsigned char* data, size_t length) {
+    std::shared_ptr<MidiOutputGroup> group;
+    {
+        std::lock_guard<std::mutex> lock(outputGroupsMutex);
+        decltype(outputGroups)::iterator it = outputGroups.find(groupName);
+        if (it == outputGroups.end()) {
+            return;
+        }
+        group = it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(group->mutex);
+    resolveOutputGroup(group.get());
+    for (size_t i = 0; i < group->outputs.size(); i++) {
+        if (group->parallel && group->writers[i]) {
+            queueOutputWriter(group->writers[i].get(), data, length);
+        } else {
+            writeMidiOutput(group->outputs[i], data, length);
+        }
+    }
+    if (!group->sequencerPorts.empty()) {
+        outputSequencerGroup(group->sequencerPorts, data, length);
+    }
+}
+
+long long currentTimestamp() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// per-frame event snapshot, structure of arrays, double buffered
+// I/O threads append to the write side, SwapMidiFrame hands the other side to the managed code
+#define MIDI_FRAME_CAPACITY 4096
+
+struct MidiFrameBuffer {
+    long long timestamps[MIDI_FRAME_CAPACITY];
+    int handles[MIDI_FRAME_CAPACITY];
+    unsigned char status[MIDI_FRAME_CAPACITY];
+    unsigned char data1[MIDI_FRAME_CAPACITY];
+    unsigned char data2[MIDI_FRAME_CAPACITY];
+    std::atomic<int> count;
+    std::atomic<int> writers;
+};
+
+MidiFrameBuffer midiFrameBuffers[2];
+std::atomic<int> midiFrameWriteIndex;
+std::atomic<bool> isMidiFrameEnabled;
+std::atomic<long long> midiFrameDropped;
+
+// system exclusive messages are not recorded: they don't fit in the fixed columns
+void recordMidiFrameEvent(long long timestamp, int handle, unsigned char status, unsigned char data1, unsigned char data2) {
+    if (!isMidiFrameEnabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    while (true) {
+        int index = midiFrameWriteIndex.load();
+        MidiFrameBuffer& frame = midiFrameBuffers[index];
+        frame.writers.fetch_add(1);
+        if (midiFrameWriteIndex.load() != index) {
+            // swapped while entering, retry with the new write side
+            frame.writers.fetch_sub(1);
+            continue;
+        }
+
+        int slot = frame.count.fetch_add(1, std::memory_order_relaxed);
+        if (slot < MIDI_FRAME_CAPACITY) {
+            frame.timestamps[slot] = timestamp;
+            frame.handles[slot] = handle;
+            frame.status[slot] = status;
+            frame.data1[slot] = data1;
+            frame.data2[slot] = data2;
+        }
+        frame.writers.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+}
+
+// event subscriptions
+// every subscriber owns a bounded multi producer ring, the I/O threads only ever push: a full ring drops the event
+// for that subscriber alone, so a slow subscriber never delays the readers or the other subscribers
+#define MIDI_SUBSCRIPTION_DEFAULT_CAPACITY 1024
+#define MIDI_SUBSCRIPTION_BATCH 64
+
+struct MidiSubscriberSlot {
+    std::atomic<unsigned int> sequence;
+    MidiEvent event;
+};
+
+struct MidiSubscriber {
+    int id;
+    MidiSubscriptionFilter filter;
+    int mode;
+    OnMidiEventsDelegate callback;
+
+    std::unique_ptr<MidiSubscriberSlot[]> slots;
+    unsigned int mask;
+    std::atomic<unsigned int> head; // next slot to claim, shared by the producers
+    unsigned int tail;              // next slot to read, owned by the consumer
+    std::atomic<long long> dropped;
+    std::atomic<int> references; // the lists it's in, plus each of its workers
+
+    // callback mode only, the worker is a plugin thread of the session
+    int eventFd;
+    std::atomic<bool> waiting; // the worker is about to sleep on eventFd
+    std::atomic<bool> stopped; // unsubscribed
+    std::atomic<unsigned int> generation; // a worker left stuck by TerminateMidiLinux ends once a newer one started
+    std::atomic<int> workers;
+    std::mutex consumerMutex; // held while popping, in case the stuck worker comes back
+};
+
+// immutable, replaced as a whole like the device registry, read inside a MidiReadSection
+struct MidiSubscriberList {
+    std::vector<MidiSubscriber*> subscribers;
+};
+
+MidiSubscriberList emptySubscriberList;
+std::atomic<MidiSubscriberList*> subscriberList(&emptySubscriberList);
+
+std::mutex subscribersWriterMutex;
+int nextSubscriptionId = 1;
+bool areSubscriberWorkersStarted; // between InitializeMidiLinux and TerminateMidiLinux
+
+unsigned int midiMessageTypeBit(unsigned char status) {
+    return status >= 0xf0 ? 1u << (0x10 + (status & 0xf)) : 1u << (status >> 4);
+}
+
+bool matchesSubscriptionFilter(const MidiSubscriptionFilter& filter, const MidiEvent& event) {
+    if (filter.handle != 0 && filter.handle != event.handle) {
+        return false;
+    }
+    if ((filter.messageTypes & midiMessageTypeBit(event.status)) == 0) {
+        return false;
+    }
+    return event.status >= 0xf0 || (filter.channels & (1 << (event.status & 0xf))) != 0;
+}
+
+bool pushSubscriberEvent(MidiSubscriber* subscriber, const MidiEvent& event) {
+    unsigned int position = subscriber->head.load(std::memory_order_relaxed);
+    MidiSubscriberSlot* slot;
+    while (true) {
+        slot = &subscriber->slots[position & subscriber->mask];
+        unsigned int sequence = slot->sequence.load(std::memory_order_acquire);
+        int difference = (int)(sequence - position);
+        if (difference == 0) {
+            if (subscriber->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // full
+            subscriber->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            position = subscriber->head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->event = event;
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+// single consumer
+bool popSubscriberEvent(MidiSubscriber* subscriber, MidiEvent& event) {
+    MidiSubscriberSlot* slot = &subscriber->slots[subscriber->tail & subscriber->mask];
+    if ((int)(slot->sequence.load(std::memory_order_acquire) - (subscriber->tail + 1)) < 0) {
+        return false;
+    }
+    event = slot->event;
+    slot->sequence.store(subscriber->tail + subscriber->mask + 1, std::memory_order_release);
+    subscriber->tail++;
+    return true;
+}
+
+bool hasSubscriberEvent(MidiSubscriber* subscriber) {
+    MidiSubscriberSlot* slot = &subscriber->slots[subscriber->tail & subscriber->mask];
+    return (int)(slot->sequence.load(std::memory_order_acquire) - (subscriber->tail + 1)) >= 0;
+}
+
+// fans one event out to every matching subscriber
+void publishMidiEvent(const MidiSubscriberList* subscribers, const MidiEvent& event) {
+    for (std::vector<MidiSubscriber*>::const_iterator it = subscribers->subscribers.begin(); it != subscribers->subscribers.end(); ++it) {
+        MidiSubscriber* subscriber = *it;
+        if (!matchesSubscriptionFilter(subscriber->filter, event) || !pushSubscriberEvent(subscriber, event)) {
+            continue;
+        }
+        if (subscriber->mode == MIDI_SUBSCRIPTION_CALLBACK) {
+            // pairs with the fence of the worker, either it sees the event or we see it waiting
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (subscriber->waiting.load(std::memory_order_relaxed) && subscriber->waiting.exchange(false)) {
+                uint64_t wakeup = 1;
+                write(subscriber->eventFd, &wakeup, sizeof(wakeup));
+            }
+        }
+    }
+}
+
+void releaseMidiSubscriber(MidiSubscriber* subscriber) {
+    if (subscriber->references.fetch_sub(1) != 1) {
+        return;
+    }
+    if (subscriber->eventFd >= 0) {
+        close(subscriber->eventFd);
+    }
+    delete subscriber;
+}
+
+// the subscriber whose callback runs on this thread
+thread_local MidiSubscriber* currentSubscriber;
+
+void subscriberWorker(MidiSubscriber* subscriber, unsigned int generation) {
+    char threadName[32];
+    sprintf(threadName, "midi-sub %d", subscriber->id);
+    configureCurrentThread(MIDI_THREAD_SUBSCRIBER, threadName);
+    currentSubscriber = subscriber;
+    int stopFd = wakeupFd;
+
+    MidiEvent events[MIDI_SUBSCRIPTION_BATCH];
+    while (!subscriber->stopped && !isStopped) {
+        int count = 0;
+        {
+            std::lock_guard<std::mutex> lock(subscriber->consumerMutex);
+            if (subscriber->generation != generation) {
+                break;
+            }
+            while (count < MIDI_SUBSCRIPTION_BATCH && popSubscriberEvent(subscriber, events[count])) {
+                count++;
+            }
+        }
+        if (count > 0) {
+            subscriber->callback(subscriber->id, events, count);
+            continue;
+        }
+
+        subscriber->waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hasSubscriberEvent(subscriber) || subscriber->stopped) {
+            subscriber->waiting.store(false);
+            continue;
+        }
+
+        struct pollfd descriptors[2];
+        descriptors[0].fd = subscriber->eventFd;
+        descriptors[0].events = POLLIN;
+        descriptors[1].fd = stopFd;
+        descriptors[1].events = POLLIN;
+        if (poll(descriptors, 2, -1) > 0) {
+            if (descriptors[1].revents) {
+                break;
+            }
+            uint64_t wakeups;
+            read(subscriber->eventFd, &wakeups, sizeof(wakeups));
+        }
+    }
+
+    currentSubscriber = nullptr;
+    subscriber->workers.fetch_sub(1);
+    releaseMidiSubscriber(subscriber);
+}
+
+// caller holds subscribersWriterMutex
+void startSubscriberWorker(MidiSubscriber* subscriber) {
+    subscriber->references.fetch_add(1);
+    subscriber->workers.fetch_add(1);
+    startMidiThread(subscriberWorker, subscriber, subscriber->generation.fetch_add(1) + 1);
+}
+
+// caller holds subscribersWriterMutex
+void publishSubscriberList(MidiSubscriberList* list) {
+    MidiSubscriberList* previous = subscriberList.exchange(list);
+    if (previous != &emptySubscriberList) {
+        // the I/O threads may still fan out through it
+        retireAfterGracePeriod([previous]() { delete previous; });
+    }
+}
+
+// UMP (MIDI 2.0 Universal MIDI Packet) translation, following the default translation of the MIDI 2.0 specification
+
+// packet size in 32-bit words, indexed by message type
+const int UMP_PACKET_WORDS[16] = {1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+
+#define UMP_MESSAGE_TYPE(word) (((word) >> 28) & 0xf)
+
+OnUmpPacketDelegate onUmpPacket;
+
+// min-center-max upscaling, keeps the center value exact
+unsigned int scaleUp(unsigned int value, int sourceBits, int destinationBits) {
+    int scaleBits = destinationBits - sourceBits;
+    unsigned int bitShiftedValue = value << scaleBits;
+    unsigned int sourceCenter = 1u << (sourceBits - 1);
+    if (value <= sourceCenter) {
+        return bitShiftedValue;
+    }
+
+    // expand the bits below the MSB over the new low bits
+    int repeatBits = sourceBits - 1;
+    unsigned int repeatMask = (1u << repeatBits) - 1;
+    unsigned int repeatValue = value & repeatMask;
+    if (scaleBits > repeatBits) {
+        repeatValue <<= scaleBits - repeatBits;
+    } else {
+        repeatValue >>= repeatBits - scaleBits;
+    }
+    while (repeatValue != 0) {
+        bitShiftedValue |= repeatValue;
+        repeatValue >>= repeatBits;
+    }
+    return bitShiftedValue;
+}
+
+// every MIDI 1.0 short message kind, described once
+// the encoders of SendMidi*, the sequencer translation, the parser and the callback formatting are generated from it
+#define MIDI_DATA_NONE 0
+#define MIDI_DATA_1    1 // one data byte
+#define MIDI_DATA_2    2 // two data bytes, e.g. note and velocity
+#define MIDI_DATA_14   3 // one 14 bit value, least significant 7 bits first
+
+// how the sequencer event holds the data
+#define MIDI_SEQUENCER_NONE    0
+#define MIDI_SEQUENCER_NOTE    1 // ev->data.note
+#define MIDI_SEQUENCER_CONTROL 2 // ev->data.control
+#define MIDI_SEQUENCER_QUEUE   3 // queue control, sent to the port directly
+
+struct MidiMessageKind {
+    unsigned char status; // without the channel
+    unsigned char length; // with the status byte, 0 for system exclusive and undefined status
+    unsigned char data; // MIDI_DATA_*
+    bool hasChannel;
+    snd_seq_event_type_t sequencerType; // SND_SEQ_EVENT_NONE without a sequencer event
+    unsigned char sequencerData; // MIDI_SEQUENCER_*
+    const char* callback; // nullptr if not delivered as a short message
+};
+
+// indexed by midiMessageIndex
+constexpr MidiMessageKind MIDI_MESSAGE_KINDS[] = {
+    {0x80, 3, MIDI_DATA_2, true, SND_SEQ_EVENT_NOTEOFF, MIDI_SEQUENCER_NOTE, "OnMidiNoteOff"},
+    {0x90, 3, MIDI_DATA_2, true, SND_SEQ_EVENT_NOTEON, MIDI_SEQUENCER_NOTE, "OnMidiNoteOn"},
+    {0xa0, 3, MIDI_DATA_2, true, SND_SEQ_EVENT_KEYPRESS, MIDI_SEQUENCER_NOTE, "OnMidiPolyphonicAftertouch"},
+    {0xb0, 3, MIDI_DATA_2, true, SND_SEQ_EVENT_CONTROLLER, MIDI_SEQUENCER_CONTROL, "OnMidiControlChange"},
+    {0xc0, 2, MIDI_DATA_1, true, SND_SEQ_EVENT_PGMCHANGE, MIDI_SEQUENCER_CONTROL, "OnMidiProgramChange"},
+    {0xd0, 2, MIDI_DATA_1, true, SND_SEQ_EVENT_CHANPRESS, MIDI_SEQUENCER_CONTROL, "OnMidiChannelAftertouch"},
+    {0xe0, 3, MIDI_DATA_14, true, SND_SEQ_EVENT_PITCHBEND, MIDI_SEQUENCER_CONTROL, "OnMidiPitchWheel"},
+    {0xf0, 0, MIDI_DATA_NONE, false, SND_SEQ_EVENT_NONE, MIDI_SEQUENCER_NONE, nullptr}, // variable length, see parseMidi
+    {0xf1, 2, MIDI_DATA_1, false, SND_SEQ_EVENT_QFRAME, MIDI_SEQUENCER_CONTROL, "OnMidiTimeCodeQuarterFrame"},
+    {0xf2, 3, MIDI_DATA_14, false, SND_SEQ_EVENT_SONGPOS, MIDI_SEQUENCER_CONTROL, "OnMidiSongPositionPointer"},
+    {0xf3, 2, MIDI_DATA_1, false, SND_SEQ_EVENT_SONGSEL, MIDI_SEQUENCER_CONTROL, "OnMidiSongSelect"},
+    {0xf4, 0, MIDI_DATA_NONE, false, SND_SEQ_EVENT_NONE, MIDI_SEQUENCER_NONE, nullptr},
+    {0xf5, 0, MIDI_DATA_NONE, false, SND_SEQ_EVENT_NONE, MIDI_SEQUENCER_NONE, nullptr},
+    {0xf6, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_TUNE_REQUEST, MIDI_SEQUENCER_NONE, "OnMidiTuneRequest"},
+    {0xf7, 0, MIDI_DATA_NONE, false, SND_SEQ_EVENT_NONE, MIDI_SEQUENCER_NONE, nullptr},
+    {0xf8, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_CLOCK, MIDI_SEQUENCER_NONE, "OnMidiTimingClock"},
+    {0xf9, 0, MIDI_DATA_NONE, false, SND_SEQ_EVENT_NONE, MIDI_SEQUENCER_NONE, nullptr},
+    {0xfa, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_START, MIDI_SEQUENCER_QUEUE, "OnMidiStart"},
+    {0xfb, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_CONTINUE, MIDI_SEQUENCER_QUEUE, "OnMidiContinue"},
+    {0xfc, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_STOP, MIDI_SEQUENCER_QUEUE, "OnMidiStop"},
+    {0xfd, 0, MIDI_DATA_NONE, false, SND_SEQ_EVENT_NONE, MIDI_SEQUENCER_NONE, nullptr},
+    {0xfe, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_SENSING, MIDI_SEQUENCER_NONE, "OnMidiActiveSensing"},
+    {0xff, 1, MIDI_DATA_NONE, false, SND_SEQ_EVENT_RESET, MIDI_SEQUENCER_NONE, "OnMidiReset"},
+};
+
+// status bytes only
+constexpr int midiMessageIndex(unsigned char status) {
+    return status < 0xf0 ? (status >> 4) - 8 : 7 + (status & 0xf);
+}
+
+constexpr const MidiMessageKind& midiMessageKind(unsigned char status) {
+    return MIDI_MESSAGE_KINDS[midiMessageIndex(status)];
+}
+
+static_assert(midiMessageKind(0x9f).status == 0x90 && midiMessageKind(0xf0).status == 0xf0 && midiMessageKind(0xff).status == 0xff,
+    "MIDI_MESSAGE_KINDS is indexed by midiMessageIndex");
+
+// the data as one number: the second data byte, the 14 bit value, or the only data byte
+constexpr int midiMessageValue(const MidiMessageKind& kind, unsigned char data1, unsigned char data2) {
+    return kind.data == MIDI_DATA_14 ? data1 | (data2 << 7) : kind.data == MIDI_DATA_2 ? data2 : data1;
+}
+
+// sequencer event type to status byte, 0 for the other types
+struct MidiSequencerStatusTable {
+    unsigned char status[256];
+};
+
+constexpr MidiSequencerStatusTable makeSequencerStatusTable() {
+    MidiSequencerStatusTable table = {};
+    for (const MidiMessageKind& kind : MIDI_MESSAGE_KINDS) {
+        if (kind.sequencerType != SND_SEQ_EVENT_NONE) {
+            table.status[kind.sequencerType] = kind.status;
+        }
+    }
+    return table;
+}
+
+constexpr MidiSequencerStatusTable SEQUENCER_STATUS = makeSequencerStatusTable();
+
+// MIDI 1.0 message length by status byte, 0 for system exclusive and undefined status
+int midiMessageLength(unsigned char status) {
+    return status & 0x80 ? midiMessageKind(status).length : 0;
+}
+
+// the short message as a sequencer event, without destination
+void encodeSequencerEvent(snd_seq_event_t* ev, unsigned char status, unsigned char data1, unsigned char data2) {
+    const MidiMessageKind& kind = midiMessageKind(status);
+    snd_seq_ev_clear(ev);
+    switch (kind.sequencerData) {
+        case MIDI_SEQUENCER_NOTE:
+            ev->type = kind.sequencerType;
+            snd_seq_ev_set_fixed(ev);
+            ev->data.note.channel = status & 0xf;
+            ev->data.note.note = data1;
+            ev->data.note.velocity = data2;
+            break;
+        case MIDI_SEQUENCER_CONTROL:
+            ev->type = kind.sequencerType;
+            snd_seq_ev_set_fixed(ev);
+            ev->data.control.channel = kind.hasChannel ? status & 0xf : 0;
+            ev->data.control.param = kind.data == MIDI_DATA_2 ? data1 : 0;
+            // the sequencer's pitch bend is centered on 0
+            ev->data.control.value = midiMessageValue(kind, data1, data2) - (kind.sequencerType == SND_SEQ_EVENT_PITCHBEND ? 8192 : 0);
+            break;
+        case MIDI_SEQUENCER_QUEUE:
+            snd_seq_ev_set_queue_control(ev, kind.sequencerType, SND_SEQ_QUEUE_DIRECT, 0);
+            break;
+        default:
+            ev->type = kind.sequencerType;
+            snd_seq_ev_set_fixed(ev);
+            break;
+    }
+}
+
+// the short message of a sequencer event, returns its status byte, 0 for the other events
+unsigned char decodeSequencerEvent(const snd_seq_event_t* ev, unsigned char* data1, unsigned char* data2) {
+    unsigned char status = SEQUENCER_STATUS.status[ev->type];
+    *data1 = 0;
+    *data2 = 0;
+    if (status == 0) {
+        return 0;
+    }
+    const MidiMessageKind& kind = midiMessageKind(status);
+    if (kind.sequencerData == MIDI_SEQUENCER_NOTE) {
+        status |= ev->data.note.channel & 0xf;
+        *data1 = ev->data.note.note;
+        *data2 = ev->data.note.velocity;
+    } else if (kind.sequencerData == MIDI_SEQUENCER_CONTROL) {
+        if (kind.hasChannel) {
+            status |= ev->data.control.channel & 0xf;
+        }
+        int value = ev->data.control.value + (kind.sequencerType == SND_SEQ_EVENT_PITCHBEND ? 8192 : 0);
+        if (kind.data == MIDI_DATA_14) {
+            *data1 = value & 0x7f;
+            *data2 = (value >> 7) & 0x7f;
+        } else if (kind.data == MIDI_DATA_2) {
+            *data1 = ev->data.control.param;
+            *data2 = value;
+        } else {
+            *data1 = value;
+        }
+    }
+    return status;
+}
+
+// the SendMidi* encoders
+template <unsigned char Status>
+void sendMidiMessage(const char* deviceId, unsigned char channel, unsigned char data1, unsigned char data2) {
+    constexpr MidiMessageKind kind = midiMessageKind(Status);
+    static_assert(kind.length > 0, "short messages only");
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT);
+    if (device == nullptr) {
+        return;
+    }
+
+    unsigned char midi[3] = {(unsigned char)(kind.hasChannel ? Status | (channel & 0xf) : Status), data1, data2};
+    if (device->output) {
+        writeMidiOutput(device, midi, kind.length);
+    } else {
+        snd_seq_event_t ev;
+        encodeSequencerEvent(&ev, midi[0], data1, data2);
+        outputSequencerEvent(device, &ev);
+    }
+}
+
+template <unsigned char Status>
+void sendGroupMidiMessage(const char* groupName, unsigned char channel, unsigned char data1, unsigned char data2) {
+    constexpr MidiMessageKind kind = midiMessageKind(Status);
+    static_assert(kind.length > 0, "short messages only");
+    unsigned char midi[3] = {(unsigned char)(kind.hasChannel ? Status | (channel & 0xf) : Status), data1, data2};
+    sendGroupMessage(groupName, midi, kind.length);
+}
+
+// MIDI 1.0 short message to a MIDI 2.0 channel voice packet (upscaled) or a system packet, returns the word count
+int translateMidi1ToUmp(unsigned char status, unsigned char data1, unsigned char data2, unsigned int* words) {
+    if (status >= 0xf0) {
+        words[0] = (0x1u << 28) | (status << 16) | (data1 << 8) | data2;
+        return 1;
+    }
+
+    unsigned int opcode = status >> 4;
+    if (opcode == 0x9 && data2 == 0) {
+        // note on with velocity 0 is a note off
+        opcode = 0x8;
+    }
+    words[0] = (0x4u << 28) | (opcode << 20) | ((status & 0xf) << 16);
+    words[1] = 0;
+    switch (opcode) {
+        case 0x8:
+        case 0x9:
+            words[0] |= data1 << 8;
+            words[1] = scaleUp(data2, 7, 16) << 16;
+            break;
+        case 0xa:
+        case 0xb:
+            words[0] |= data1 << 8;
+            words[1] = scaleUp(data2, 7, 32);
+            break;
+        case 0xc:
+            words[1] = data1 << 24;
+            break;
+        case 0xd:
+            words[1] = scaleUp(data1, 7, 32);
+            break;
+        case 0xe:
+            words[1] = scaleUp(data1 | (data2 << 7), 14, 32);
+            break;
+    }
+    return 2;
+}
+
+// MIDI 1.0 short message to a MIDI 1.0 channel voice packet or a system packet, lossless
+unsigned int packMidi1AsUmp(unsigned char status, unsigned char data1, unsigned char data2) {
+    unsigned int messageType = status >= 0xf0 ? 0x1 : 0x2;
+    return (messageType << 28) | (status << 16) | (data1 << 8) | data2;
+}
+
+// splits a system exclusive message, with or without its 0xf0 / 0xf7, into data 64 packets
+template <typename Emit>
+void packSystemExclusive(const unsigned char* data, size_t length, Emit emit) {
+    if (length > 0 && data[0] == 0xf0) {
+        data++;
+        length--;
+    }
+    if (length > 0 && data[length - 1] == 0xf7) {
+        length--;
+    }
+
+    size_t offset = 0;
+    do {
+        size_t chunk = std::min<size_t>(6, length - offset);
+        unsigned int status;
+        if (offset == 0) {
+            status = chunk == length ? 0 : 1; // complete : start
+        } else {
+            status = offset + chunk == length ? 3 : 2; // end : continue
+        }
+
+        unsigned int words[2];
+        words[0] = (0x3u << 28) | (status << 20) | (chunk << 16);
+        words[1] = 0;
+        for (size_t i = 0; i < chunk; i++) {
+            unsigned int value = data[offset + i] & 0x7f;
+            if (i < 2) {
+                words[0] |= value << (8 * (1 - i));
+            } else {
+                words[1] |= value << (8 * (5 - i));
+            }
+        }
+        emit(words);
+        offset += chunk;
+    } while (offset < length);
+}
+
+// UMP packet to a MIDI 1.0 byte stream, returns the byte count (at most 12)
+// MIDI 2.0 only messages (per-note controllers, utility, flex data...) have no MIDI 1.0 equivalent and translate to nothing
+int translateUmpToMidi1(const unsigned int* words, unsigned char* bytes) {
+    unsigned int word = words[0];
+    int count = 0;
+
+    switch (UMP_MESSAGE_TYPE(word)) {
+        case 0x1: // system common and real time
+        case 0x2: { // MIDI 1.0 channel voice
+            unsigned char status = (word >> 16) & 0xff;
+            int length = midiMessageLength(status);
+            if (length > 0) {
+                bytes[count++] = status;
+            }
+            if (length > 1) {
+                bytes[count++] = (word >> 8) & 0x7f;
+            }
+            if (length > 2) {
+                bytes[count++] = word & 0x7f;
+            }
+            return count;
+        }
+        case 0x3: { // system exclusive 7 bit
+            unsigned int status = (word >> 20) & 0xf;
+            int length = std::min<int>(6, (word >> 16) & 0xf);
+            if (status == 0 || status == 1) {
+                bytes[count++] = 0xf0;
+            }
+            for (int i = 0; i < length; i++) {
+                if (i < 2) {
+                    bytes[count++] = (word >> (8 * (1 - i))) & 0x7f;
+                } else {
+                    bytes[count++] = (words[1] >> (8 * (5 - i))) & 0x7f;
+                }
+            }
+            if (status == 0 || status == 3) {
+                bytes[count++] = 0xf7;
+            }
+            return count;
+        }
+        case 0x4: { // MIDI 2.0 channel voice
+            unsigned char channel = (word >> 16) & 0xf;
+            unsigned char index = (word >> 8) & 0x7f;
+            unsigned int data = words[1];
+            switch ((word >> 20) & 0xf) {
+                case 0x8: // note off
+                    bytes[count++] = 0x80 | channel;
+                    bytes[count++] = index;
+                    bytes[count++] = data >> 25;
+                    break;
+                case 0x9: { // note on, velocity 0 would mean note off
+                    unsigned char velocity = data >> 25;
+                    bytes[count++] = 0x90 | channel;
+                    bytes[count++] = index;
+                    bytes[count++] = velocity == 0 ? 1 : velocity;
+                    break;
+                }
+                case 0xa: // poly pressure
+                case 0xb: // control change
+                    bytes[count++] = (((word >> 20) & 0xf) << 4) | channel;
+                    bytes[count++] = index;
+                    bytes[count++] = data >> 25;
+                    break;
+                case 0xc: // program change, with optional bank select
+                    if (word & 1) {
+                        bytes[count++] = 0xb0 | channel;
+                        bytes[count++] = 0;
+                        bytes[count++] = (data >> 8) & 0x7f;
+                        bytes[count++] = 0xb0 | channel;
+                        bytes[count++] = 32;
+                        bytes[count++] = data & 0x7f;
+                    }
+                    bytes[count++] = 0xc0 | channel;
+                    bytes[count++] = (data >> 24) & 0x7f;
+                    break;
+                case 0xd: // channel pressure
+                    bytes[count++] = 0xd0 | channel;
+                    bytes[count++] = data >> 25;
+                    break;
+                case 0xe: { // pitch bend
+                    unsigned int amount = data >> 18;
+                    bytes[count++] = 0xe0 | channel;
+                    bytes[count++] = amount & 0x7f;
+                    bytes[count++] = (amount >> 7) & 0x7f;
+                    break;
+                }
+                case 0x2: // registered controller: RPN
+                case 0x3: { // assignable controller: NRPN
+                    bool registered = ((word >> 20) & 0xf) == 0x2;
+                    unsigned char controllers[4] = {(unsigned char)(registered ? 101 : 99), (unsigned char)(registered ? 100 : 98), 6, 38};
+                    unsigned char values[4] = {index, (unsigned char)(word & 0x7f), (unsigned char)(data >> 25), (unsigned char)((data >> 18) & 0x7f)};
+                    for (int i = 0; i < 4; i++) {
+                        bytes[count++] = 0xb0 | channel;
+                        bytes[count++] = controllers[i];
+                        bytes[count++] = values[i];
+                    }
+                    break;
+                }
+            }
+            return count;
+        }
+    }
+    return 0;
+}
+
+void deliverUmpPacket(int handle, const unsigned int* words, int wordCount) {
+    OnUmpPacketDelegate callback = onUmpPacket;
+    if (callback) {
+        callback(handle, words, wordCount);
+    }
+}
+
+// every parsed MIDI 1.0 short message goes through here
+// translateToUmp is false for streams that were UMP to begin with, their packets are delivered as received
+void dispatchMidiMessage(int handle, long long timestamp, unsigned char status, unsigned char data1, unsigned char data2, bool translateToUmp) {
+    recordMidiFrameEvent(timestamp, handle, status, data1, data2);
+
+    {
+        MidiReadSection section;
+        const MidiSubscriberList* subscribers = subscriberList.load(std::memory_order_acquire);
+        if (!subscribers->subscribers.empty()) {
+            MidiEvent event;
+            event.timestamp = timestamp;
+            event.handle = handle;
+            event.status = status;
+            event.data1 = data1;
+            event.data2 = data2;
+            event.length = 0;
+            publishMidiEvent(subscribers, event);
+        }
+    }
+
+    if (translateToUmp && onUmpPacket) {
+        unsigned int words[2];
+        int wordCount = translateMidi1ToUmp(status, data1, data2, words);
+        deliverUmpPacket(handle, words, wordCount);
+    }
+}
+
+// data holds the whole message, 0xf0 to 0xf7
+void dispatchSystemExclusive(int handle, long long timestamp, const unsigned char* data, size_t length, bool translateToUmp) {
+    {
+        MidiReadSection section;
+        const MidiSubscriberList* subscribers = subscriberList.load(std::memory_order_acquire);
+        if (!subscribers->subscribers.empty()) {
+            MidiEvent event;
+            event.timestamp = timestamp;
+            event.handle = handle;
+            event.status = 0xf0;
+            event.data1 = 0;
+            event.data2 = 0;
+            for (size_t offset = 0; offset < length; offset += sizeof(event.sysex)) {
+                event.length = std::min(sizeof(event.sysex), length - offset);
+                memcpy(event.sysex, data + offset, event.length);
+                publishMidiEvent(subscribers, event);
+            }
+        }
+    }
+
+    if (translateToUmp && onUmpPacket) {
+        packSystemExclusive(data, length, [handle](const unsigned int* words) {
+            deliverUmpPacket(handle, words, 2);
+        });
+    }
+}
+
+#ifdef MIDI_UMP_SUPPORTED
+// MIDI 1.0 messages sent to a UMP endpoint, caller holds the port mutex
+void writeUmpOutput(MidiOutputPort* port, const unsigned char* data, size_t length) {
+    if (length > 0 && data[0] == 0xf0) {
+        packSystemExclusive(data, length, [port](const unsigned int* words) {
+            snd_ump_write(port->ump, words, 2 * sizeof(unsigned int));
+        });
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < length) {
+        int messageLength = midiMessageLength(data[offset]);
+        if (messageLength == 0 || offset + messageLength > length) {
+            break;
+        }
+        unsigned int word = packMidi1AsUmp(data[offset], messageLength > 1 ? data[offset + 1] : 0, messageLength > 2 ? data[offset + 2] : 0);
+        snd_ump_write(port->ump, &word, sizeof(word));
+        offset += messageLength;
+    }
+}
+#endif
+
+// MPE state of each device, updated by the dispatch thread, polled by the managed side
+#define MIDI_MPE_RPN_NULL 127
+#define MIDI_MPE_MAX_NOTES 128
+
+struct MidiMpeNoteSlot {
+    MidiMpeNote note;
+    bool isDirty;
+};
+
+struct MidiMpeState {
+    int lowerMembers; // channels 1 to lowerMembers, the manager is channel 0
+    int upperMembers; // channels 14 - upperMembers + 1 to 14, the manager is channel 15
+    unsigned char rpnMsb[16];
+    unsigned char rpnLsb[16];
+    short pitchBend[16];
+    unsigned char pitchBendRange[16];
+    unsigned char timbre[16];
+    unsigned char pressure[16];
+    std::vector<MidiMpeNoteSlot> notes;
+};
+
+std::map<int, MidiMpeState> mpeStates; // by handle
+std::mutex mpeMutex;
+std::atomic<bool> isMpeEnabled;
+std::atomic<long long> mpeOverflows;
+
+MidiMpeState& mpeState(int handle) {
+    std::map<int, MidiMpeState>::iterator it = mpeStates.find(handle);
+    if (it != mpeStates.end()) {
+        return it->second;
+    }
+    MidiMpeState& state = mpeStates[handle];
+    state.lowerMembers = 0;
+    state.upperMembers = 0;
+    for (int i = 0; i < 16; i++) {
+        state.rpnMsb[i] = MIDI_MPE_RPN_NULL;
+        state.rpnLsb[i] = MIDI_MPE_RPN_NULL;
+        state.pitchBend[i] = 0;
+        state.pitchBendRange[i] = 2;
+        state.timbre[i] = 64;
+        state.pressure[i] = 0;
+    }
+    state.notes.reserve(MIDI_MPE_MAX_NOTES);
+    return state;
+}
+
+bool isMpeMemberChannel(const MidiMpeState& state, int channel) {
+    return (channel >= 1 && channel <= state.lowerMembers) || (channel <= 14 && channel > 14 - state.upperMembers);
+}
+
+// MPE Configuration Message, the new zone shrinks the other one when they overlap, a 15 member zone turns it off
+void configureMpeZone(MidiMpeState& state, int managerChannel, int members) {
+    members = std::min(members, 15);
+    if (managerChannel == 0) {
+        state.lowerMembers = members;
+        state.upperMembers = std::max(0, std::min(state.upperMembers, 14 - members));
+    } else {
+        state.upperMembers = members;
+        state.lowerMembers = std::max(0, std::min(state.lowerMembers, 14 - members));
+    }
+    for (int channel = 0; channel < 16; channel++) {
+        state.pitchBendRange[channel] = isMpeMemberChannel(state, channel) ? 48 : 2;
+    }
+    state.notes.clear();
+}
+
+// applies the value to the notes sounding on the channel
+template <typename Update>
+void updateMpeNotes(MidiMpeState& state, int channel, Update update) {
+    for (std::vector<MidiMpeNoteSlot>::iterator it = state.notes.begin(); it != state.notes.end(); ++it) {
+        if (it->note.channel == channel && it->note.isActive) {
+            update(it->note);
+            it->isDirty = true;
+        }
+    }
+}
+
+// caller holds mpeMutex, returns true when the event is replaced by the per-note state
+bool trackMpeEvent(int handle, const MidiEvent& event) {
+    unsigned char kind = event.status & 0xf0;
+    if (kind < 0x80 || kind == 0xf0) {
+        return false;
+    }
+    MidiMpeState& state = mpeState(handle);
+    int channel = event.status & 0xf;
+
+    switch (kind) {
+        case 0xb0:
+            switch (event.data1) {
+                case 101:
+                    state.rpnMsb[channel] = event.data2;
+                    return false;
+                case 100:
+                    state.rpnLsb[channel] = event.data2;
+                    return false;
+                case 99:
+                case 98:
+                    state.rpnMsb[channel] = MIDI_MPE_RPN_NULL;
+                    state.rpnLsb[channel] = MIDI_MPE_RPN_NULL;
+                    return false;
+                case 6:
+                    if (state.rpnMsb[channel] == 0 && state.rpnLsb[channel] == 6 && (channel == 0 || channel == 15)) {
+                        configureMpeZone(state, channel, event.data2);
+                    } else if (state.rpnMsb[channel] == 0 && state.rpnLsb[channel] == 0) {
+                        // pitch bend sensitivity, a member channel sets it for its whole zone
+                        bool isLower = channel >= 1 && channel <= state.lowerMembers;
+                        for (int i = 0; i < 16; i++) {
+                            bool isSameZone = isLower ? (i >= 1 && i <= state.lowerMembers) : (i <= 14 && i > 14 - state.upperMembers);
+                            if (i == channel || (isMpeMemberChannel(state, channel) && isSameZone)) {
+                                state.pitchBendRange[i] = event.data2;
+                                updateMpeNotes(state, i, [&event](MidiMpeNote& note) { note.pitchBendRange = event.data2; });
+                            }
+                        }
+                    }
+                    return false;
+                case 74:
+                    if (!isMpeMemberChannel(state, channel)) {
+                        return false;
+                    }
+                    state.timbre[channel] = event.data2;
+                    updateMpeNotes(state, channel, [&event](MidiMpeNote& note) { note.timbre = event.data2; });
+                    return true;
+            }
+            return false;
+        case 0xd0:
+            if (!isMpeMemberChannel(state, channel)) {
+                return false;
+            }
+            state.pressure[channel] = event.data1;
+            updateMpeNotes(state, channel, [&event](MidiMpeNote& note) { note.pressure = event.data1; });
+            return true;
+        case 0xe0: {
+            if (!isMpeMemberChannel(state, channel)) {
+                return false;
+            }
+            short pitchBend = (event.data1 | (event.data2 << 7)) - 8192;
+            state.pitchBend[channel] = pitchBend;
+            updateMpeNotes(state, channel, [pitchBend](MidiMpeNote& note) { note.pitchBend = pitchBend; });
+            return true;
+        }
+        case 0x80:
+        case 0x90:
+            if (!isMpeMemberChannel(state, channel)) {
+                return false;
+            }
+            for (std::vector<MidiMpeNoteSlot>::iterator it = state.notes.begin(); it != state.notes.end(); ++it) {
+                if (it->note.channel == channel && it->note.note == event.data1 && it->note.isActive) {
+                    // released, or retriggered
+                    it->note.isActive = 0;
+                    it->note.releaseVelocity = kind == 0x80 ? event.data2 : 0;
+                    it->isDirty = true;
+                }
+            }
+            if (kind == 0x90 && event.data2 > 0 && state.notes.size() >= MIDI_MPE_MAX_NOTES) {
+                // the oldest released note makes room, its last update is lost; with every note sounding the new one isn't tracked
+                std::vector<MidiMpeNoteSlot>::iterator released = state.notes.begin();
+                while (released != state.notes.end() && released->note.isActive) {
+                    ++released;
+                }
+                if (released == state.notes.end()) {
+                    mpeOverflows++;
+                    return false;
+                }
+                state.notes.erase(released);
+            }
+            if (kind == 0x90 && event.data2 > 0) {
+                MidiMpeNoteSlot slot;
+                slot.note.handle = handle;
+                slot.note.channel = channel;
+                slot.note.note = event.data1;
+                slot.note.velocity = event.data2;
+                slot.note.releaseVelocity = 0;
+                // expression sent before the note on already applies to it
+                slot.note.pitchBend = state.pitchBend[channel];
+                slot.note.pitchBendRange = state.pitchBendRange[channel];
+                slot.note.timbre = state.timbre[channel];
+                slot.note.pressure = state.pressure[channel];
+                slot.note.isActive = 1;
+                slot.isDirty = true;
+                state.notes.push_back(slot);
+            }
+            // the notes themselves are still sent
+            return false;
+    }
+    return false;
+}
+
+// per-device input queues, between the readers and the message callback
+// the readers parse and enqueue, the dispatch thread formats the messages and calls onSendMessage:
+// a slow consumer fills a queue instead of stalling the reader until the kernel buffer overflows
+#define MIDI_QUEUE_DEFAULT_CAPACITY 1024
+#define MIDI_QUEUE_MAX_CAPACITY (1 << 20)
+#define MIDI_QUEUE_BATCH 64
+#define MIDI_QUEUE_DELIVERY_TIMEOUT std::chrono::milliseconds(500) // the detach waits this long for the last events
+
+struct MidiInputQueueConfig {
+    int capacity;
+    int policy;
+};
+
+// system exclusive messages are queued as MidiEvent chunks, data1 flags the first chunk and data2 the last one
+struct MidiInputQueue {
+    std::string deviceId;
+    std::string messagePrefix; // "deviceId,0," of every formatted message
+    int handle;
+    bool trailingSeparator; // sysex formatting of the sequencer path
+
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::vector<MidiEvent> events; // ring
+    size_t head;
+    size_t count;
+    size_t highWater;
+    int policy;
+    bool closed;
+    bool isDelivered; // closed, and the dispatch thread delivered the last event
+    std::condition_variable delivered;
+
+    std::atomic<long long> dropped;
+    std::atomic<long long> coalesced;
+    std::atomic<long long> resyncs;
+
+    // dispatch thread only
+    long long reportedOverflows;
+    std::vector<unsigned char> systemExclusive;
+    long long systemExclusiveDropped; // dropped count when the pending message started
+};
+
+MidiInputQueueConfig defaultInputQueueConfig = {MIDI_QUEUE_DEFAULT_CAPACITY, MIDI_QUEUE_BLOCK};
+std::map<std::string, MidiInputQueueConfig, std::less<>> inputQueueConfigs;
+std::mutex inputQueueConfigsMutex;
+
+// every open queue, the dispatch thread removes the closed ones once drained
+std::list<std::shared_ptr<MidiInputQueue>> inputQueues;
+std::mutex inputQueuesMutex;
+
+OnMidiInputOverflowDelegate onMidiInputOverflow;
+std::atomic<long long> inputDropped;
+std::atomic<long long> inputResyncs;
+
+int dispatchFd = -1;
+std::atomic<bool> dispatchPending;
+std::atomic<bool> dispatcherWaiting; // the dispatch thread is about to sleep on dispatchFd
+
+void wakeMidiDispatcher() {
+    dispatchPending.store(true);
+    if (dispatcherWaiting.load(std::memory_order_relaxed) && dispatcherWaiting.exchange(false)) {
+        uint64_t wakeup = 1;
+        write(dispatchFd, &wakeup, sizeof(wakeup));
+    }
+}
+
+// caller holds the queue mutex, the capacity may shrink: the oldest events are dropped then
+void resizeInputQueue(MidiInputQueue* queue, size_t capacity) {
+    std::vector<MidiEvent> events(capacity);
+    size_t kept = std::min(queue->count, capacity);
+    size_t skipped = queue->count - kept;
+    for (size_t i = 0; i < kept; i++) {
+        events[i] = queue->events[(queue->head + skipped + i) % queue->events.size()];
+    }
+    queue->events.swap(events);
+    queue->head = 0;
+    queue->count = kept;
+    queue->dropped += skipped;
+    inputDropped += skipped;
+}
+
+std::shared_ptr<MidiInputQueue> openInputQueue(const char* deviceId, int handle, bool trailingSeparator) {
+    MidiInputQueueConfig config;
+    {
+        std::lock_guard<std::mutex> lock(inputQueueConfigsMutex);
+        decltype(inputQueueConfigs)::iterator it = inputQueueConfigs.find(deviceId);
+        config = it != inputQueueConfigs.end() ? it->second : defaultInputQueueConfig;
+    }
+
+    std::shared_ptr<MidiInputQueue> queue = std::make_shared<MidiInputQueue>();
+    queue->deviceId = deviceId;
+    queue->messagePrefix = queue->deviceId + ",0,";
+    queue->handle = handle;
+    queue->trailingSeparator = trailingSeparator;
+    queue->events.resize(config.capacity);
+    queue->head = 0;
+    queue->count = 0;
+    queue->highWater = 0;
+    queue->policy = config.policy;
+    queue->closed = false;
+    queue->isDelivered = false;
+    queue->dropped = 0;
+    queue->coalesced = 0;
+    queue->resyncs = 0;
+    queue->reportedOverflows = 0;
+    queue->systemExclusive.reserve(IO_ARENA_SYSEX_RESERVE);
+    queue->systemExclusiveDropped = 0;
+
+    std::lock_guard<std::mutex> lock(inputQueuesMutex);
+    inputQueues.push_back(queue);
+    return queue;
+}
+
+// the device is gone, a reader blocked on the queue gives up
+void closeInputQueue(MidiInputQueue* queue) {
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->closed = true;
+    }
+    queue->notFull.notify_all();
+    wakeMidiDispatcher();
+}
+
+void countInputResync(MidiInputQueue* queue) {
+    if (queue != nullptr) {
+        queue->resyncs++;
+    }
+    inputResyncs++;
+}
+
+// continuous messages of the same controller, note or channel, caller holds the queue mutex
+bool coalesceInputEvent(MidiInputQueue* queue, const MidiEvent& event) {
+    unsigned char kind = event.status & 0xf0;
+    if (kind != 0xa0 && kind != 0xb0 && kind != 0xd0 && kind != 0xe0) {
+        return false;
+    }
+    bool sameData1 = kind == 0xa0 || kind == 0xb0;
+    for (size_t i = queue->count; i > 0; i--) {
+        MidiEvent& queued = queue->events[(queue->head + i - 1) % queue->events.size()];
+        if (queued.status == event.status && (!sameData1 || queued.data1 == event.data1)) {
+            queued.data1 = event.data1;
+            queued.data2 = event.data2;
+            return true;
+        }
+    }
+    return false;
+}
+
+void enqueueInputEvent(MidiInputQueue* queue, const MidiEvent& event) {
+    MIDI_TRACE_SPAN("queue");
+    {
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        if (queue->closed) {
+            return;
+        }
+        if (queue->count == queue->events.size()) {
+            switch (queue->policy) {
+                case MIDI_QUEUE_BLOCK:
+                    while (queue->count == queue->events.size() && !queue->closed && !isStopped) {
+                        queue->notFull.wait_for(lock, std::chrono::milliseconds(10));
+                    }
+                    if (queue->count == queue->events.size()) {
+                        // closing
+                        return;
+                    }
+                    break;
+                case MIDI_QUEUE_DROP_NEWEST:
+                    queue->dropped++;
+                    inputDropped++;
+                    lock.unlock();
+                    wakeMidiDispatcher();
+                    return;
+                case MIDI_QUEUE_COALESCE:
+                    if (coalesceInputEvent(queue, event)) {
+                        queue->coalesced++;
+                        lock.unlock();
+                        wakeMidiDispatcher();
+                        return;
+                    }
+                    // fall through
+                default:
+                    queue->head = (queue->head + 1) % queue->events.size();
+                    queue->count--;
+                    queue->dropped++;
+                    inputDropped++;
+                    break;
+            }
+        }
+        queue->events[(queue->head + queue->count) % queue->events.size()] = event;
+        queue->count++;
+        queue->highWater = std::max(queue->highWater, queue->count);
+    }
+    wakeMidiDispatcher();
+}
+
+void enqueueMidiMessage(MidiInputQueue* queue, long long timestamp, unsigned char status, unsigned char data1, unsigned char data2) {
+    MidiEvent event;
+    event.timestamp = timestamp;
+    event.handle = queue->handle;
+    event.status = status;
+    event.data1 = data1;
+    event.data2 = data2;
+    event.length = 0;
+    enqueueInputEvent(queue, event);
+}
+
+void enqueueSystemExclusive(MidiInputQueue* queue, long long timestamp, const unsigned char* data, size_t length) {
+    MidiEvent event;
+    event.timestamp = timestamp;
+    event.handle = queue->handle;
+    event.status = 0xf0;
+    for (size_t offset = 0; offset < length; offset += sizeof(event.sysex)) {
+        event.length = std::min(sizeof(event.sysex), length - offset);
+        event.data1 = offset == 0;
+        event.data2 = offset + event.length == length;
+        memcpy(event.sysex, data + offset, event.length);
+        enqueueInputEvent(queue, event);
+    }
+}
+
+// formats the event for the managed callback, the messages are the same whichever path the event came from
+void sendMidiEventMessage(MidiInputQueue* queue, const MidiEvent& event) {
+    MIDI_TRACE_SPAN("format");
+    if (event.status != 0xf0) {
+        const MidiMessageKind& kind = midiMessageKind(event.status);
+        if (kind.callback == nullptr) {
+            return;
+        }
+        if (kind.data == MIDI_DATA_NONE) {
+            UnitySendMessage(GAME_OBJECT_NAME, kind.callback, queue->deviceId.c_str());
+            return;
+        }
+
+        // the prefix, then up to three values of 5 table bytes and their separators
+        size_t required = queue->messagePrefix.size() + 3 * 6 + 1;
+        if (ioArena.eventMessage.size() < required) {
+            ioArena.eventMessage.resize(required);
+        }
+        char* out = ioArena.eventMessage.data();
+        memcpy(out, queue->messagePrefix.data(), queue->messagePrefix.size());
+        out += queue->messagePrefix.size();
+        if (kind.hasChannel) {
+            out = appendDecimal(out, event.status & 0xf);
+            *out++ = ',';
+        }
+        if (kind.hasChannel && kind.data == MIDI_DATA_2) {
+            out = appendDecimal(out, event.data1);
+            *out++ = ',';
+            out = appendDecimal(out, event.data2);
+        } else {
+            out = appendDecimal(out, midiMessageValue(kind, event.data1, event.data2));
+        }
+        *out = '\0';
+        UnitySendMessage(GAME_OBJECT_NAME, kind.callback, ioArena.eventMessage.data());
+        return;
+    }
+
+    // system exclusive chunks
+    if (event.data1) {
+        queue->systemExclusive.clear();
+        queue->systemExclusiveDropped = queue->dropped.load();
+    } else if (queue->systemExclusive.empty()) {
+        // the start of the message was dropped
+        return;
+    }
+    queue->systemExclusive.insert(queue->systemExclusive.end(), event.sysex, event.sysex + event.length);
+    if (event.data2) {
+        // a message that may have lost chunks is not delivered
+        if (queue->dropped.load() == queue->systemExclusiveDropped) {
+            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSystemExclusive",
+                formatSystemExclusive(queue->messagePrefix, queue->systemExclusive.data(), queue->systemExclusive.size(), queue->trailingSeparator));
+        }
+        queue->systemExclusive.clear();
+    }
+}
+
+// delivers a batch of the events stamped until then at the latest, returns the number of events
+int drainInputQueue(MidiInputQueue* queue, long long until) {
+    MIDI_TRACE_SPAN("drain");
+    MidiEvent events[MIDI_QUEUE_BATCH];
+    int count = 0;
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        bool wasFull = queue->count == queue->events.size();
+        while (count < MIDI_QUEUE_BATCH && queue->count > 0 && queue->events[queue->head].timestamp <= until) {
+            events[count++] = queue->events[queue->head];
+            queue->head = (queue->head + 1) % queue->events.size();
+            queue->count--;
+        }
+        if (wasFull && count > 0) {
+            queue->notFull.notify_all();
+        }
+    }
+
+    bool isReplaced[MIDI_QUEUE_BATCH] = {};
+    if (count > 0 && isMpeEnabled.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mpeMutex);
+        for (int i = 0; i < count; i++) {
+            isReplaced[i] = trackMpeEvent(queue->handle, events[i]);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!isReplaced[i]) {
+            sendMidiEventMessage(queue, events[i]);
+        }
+    }
+
+    long long dropped = queue->dropped.load();
+    long long coalesced = queue->coalesced.load();
+    if (dropped + coalesced != queue->reportedOverflows) {
+        queue->reportedOverflows = dropped + coalesced;
+        OnMidiInputOverflowDelegate callback = onMidiInputOverflow;
+        if (callback) {
+            callback(queue->handle, dropped, coalesced);
+        }
+    }
+    return count;
+}
+
+// dispatch thread, after delivering the batches it took from the queue
+bool isInputQueueDrained(MidiInputQueue* queue) {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (queue->closed && queue->count == 0 && !queue->isDelivered) {
+        queue->isDelivered = true;
+        queue->delivered.notify_all();
+    }
+    return queue->isDelivered;
+}
+
+// until the events queued before the close are delivered, so the detach message comes after them
+void waitInputQueueDelivered(MidiInputQueue* queue) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + MIDI_QUEUE_DELIVERY_TIMEOUT;
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    while (!queue->isDelivered && !isStopped && std::chrono::steady_clock::now() < deadline) {
+        queue->delivered.wait_for(lock, std::chrono::milliseconds(10));
+    }
+}
+
+// timestamp of the oldest queued event, LLONG_MAX when empty
+long long peekInputQueue(MidiInputQueue* queue) {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->count > 0 ? queue->events[queue->head].timestamp : LLONG_MAX;
+}
+
+// set by InitializeMidiLinux from SetMidiInputShards
+int inputShardSetting;
+int inputShardCount;
+
+// k-way merge of the queues: the queue holding the oldest event delivers up to the oldest event of the next one
+// each queue is in timestamp order already, being filled by a single reader
+// events stamped after the merge started wait for the next one, so a busy device can't keep it going
+// heads is the heap storage of the dispatch thread, kept across merges so they don't allocate
+typedef std::pair<long long, MidiInputQueue*> QueueHead;
+
+int mergeInputQueues(std::vector<MidiInputQueue*>& queues, std::vector<QueueHead>& heads) {
+    long long cutoff = currentTimestamp();
+    heads.clear();
+    for (std::vector<MidiInputQueue*>::iterator it = queues.begin(); it != queues.end(); ++it) {
+        long long timestamp = peekInputQueue(*it);
+        if (timestamp <= cutoff) {
+            heads.push_back(QueueHead(timestamp, *it));
+        }
+    }
+    std::greater<QueueHead> later;
+    std::make_heap(heads.begin(), heads.end(), later);
+
+    int delivered = 0;
+    while (!heads.empty()) {
+        std::pop_heap(heads.begin(), heads.end(), later);
+        MidiInputQueue* queue = heads.back().second;
+        heads.pop_back();
+        long long until = heads.empty() ? cutoff : std::min(heads.front().first, cutoff);
+        delivered += drainInputQueue(queue, until);
+
+        long long timestamp = peekInputQueue(queue);
+        if (timestamp <= cutoff) {
+            heads.push_back(QueueHead(timestamp, queue));
+            std::push_heap(heads.begin(), heads.end(), later);
+        }
+    }
+    return delivered;
+}
+
+void midiDispatchWatcher() {
+    int stopFd = wakeupFd;
+    configureCurrentThread(MIDI_THREAD_DISPATCH, "midi-dispatch");
+    ioThreadStarted();
+
+    struct pollfd descriptors[2];
+    descriptors[0].fd = dispatchFd;
+    descriptors[0].events = POLLIN;
+    descriptors[1].fd = stopFd;
+    descriptors[1].events = POLLIN;
+
+    std::vector<MidiInputQueue*> mergedQueues;
+    std::vector<QueueHead> mergedHeads;
+    while (!isStopped) {
+        dispatchPending.store(false);
+
+        int delivered = 0;
+        std::unique_lock<std::mutex> lock(inputQueuesMutex);
+        if (inputShardCount > 0) {
+            // only this thread removes queues, so they outlive the merge
+            mergedQueues.clear();
+            for (std::list<std::shared_ptr<MidiInputQueue>>::iterator it = inputQueues.begin(); it != inputQueues.end(); ++it) {
+                mergedQueues.push_back(it->get());
+            }
+            lock.unlock();
+            delivered += mergeInputQueues(mergedQueues, mergedHeads);
+            lock.lock();
+        }
+        for (std::list<std::shared_ptr<MidiInputQueue>>::iterator it = inputQueues.begin(); it != inputQueues.end();) {
+            // the readers only append, so the iterator survives while unlocked
+            MidiInputQueue* queue = it->get();
+            lock.unlock();
+            if (inputShardCount == 0) {
+                delivered += drainInputQueue(queue, LLONG_MAX);
+            }
+            bool drained = isInputQueueDrained(queue);
+            lock.lock();
+            if (drained) {
+                it = inputQueues.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        lock.unlock();
+        if (delivered > 0) {
+            continue;
+        }
+
+        dispatcherWaiting.store(true);
+        if (dispatchPending.load()) {
+            dispatcherWaiting.store(false);
+            continue;
+        }
+        if (poll(descriptors, 2, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (descriptors[1].revents) {
+            break;
+        }
+        uint64_t wakeups;
+        read(dispatchFd, &wakeups, sizeof(wakeups));
+    }
+}
+
+// shared memory broker
+// input: the owner's readers publish the bytes they read to a broadcast ring, every client reads it at its own pace
+// and parses it like a local reader would; a client that falls a whole ring behind loses the overwritten slots
+// output: clients reserve consecutive slots of a multi producer ring, the owner writes them to the devices in order
+// a client claims each slot before filling it; a reservation left unclaimed for MIDI_BROKER_STALE_NANOS is skipped
+// by the owner, a claimed slot only once its client died, since the client may still be writing it
+// both rings wake their readers through process shared futexes, which are only called while someone sleeps
+#define MIDI_BROKER_NAME "/unity-midi-plugin-broker"
+#define MIDI_BROKER_MAGIC 0x4d494442
+#define MIDI_BROKER_VERSION 3
+#define MIDI_BROKER_DEVICES 64
+#define MIDI_BROKER_INPUT_SLOTS 4096
+#define MIDI_BROKER_OUTPUT_SLOTS 1024
+#define MIDI_BROKER_WAIT_MILLIS 100
+#define MIDI_BROKER_STALE_NANOS 1000000000LL // a reservation not claimed within this is skipped
+#define MIDI_BROKER_CLAIMED (MIDI_BROKER_OUTPUT_SLOTS / 2) // added to the position while a client fills the slot
+
+struct MidiBrokerDevice {
+    char id[32];
+    char name[64];
+    int directions; // 0 once detached, the index stays reserved for the id
+    int capabilities;
+};
+
+struct MidiBrokerInputSlot {
+    std::atomic<unsigned long long> sequence; // 2 * position + 1 while written, 2 * position + 2 once written
+    unsigned short device;
+    unsigned short length;
+    unsigned char data[20];
+};
+
+struct MidiBrokerOutputSlot {
+    std::atomic<unsigned int> sequence; // position when free, position + MIDI_BROKER_CLAIMED while filled, position + 1 once filled
+    std::atomic<int> pid; // of the claiming client, 0 until it wrote it
+    unsigned short device;
+    unsigned short length;
+    unsigned char data[56];
+};
+
+struct MidiBrokerShared {
+    std::atomic<unsigned int> magic; // set last by the owner
+    unsigned int version;
+    std::atomic<int> ownerPid; // 0 without owner
+    std::atomic<unsigned int> epoch; // bumped by every new owner, clients start over
+
+    std::atomic<unsigned int> deviceSequence; // odd while the owner updates the table
+    int deviceCount;
+    MidiBrokerDevice devices[MIDI_BROKER_DEVICES];
+
+    std::atomic<unsigned long long> inputHead;
+    std::atomic<unsigned int> inputFutex;
+    std::atomic<int> inputWaiters;
+    MidiBrokerInputSlot input[MIDI_BROKER_INPUT_SLOTS];
+
+    std::atomic<unsigned int> outputHead;
+    unsigned int outputTail; // owner only
+    std::atomic<unsigned int> outputFutex;
+    std::atomic<int> outputWaiters;
+    MidiBrokerOutputSlot output[MIDI_BROKER_OUTPUT_SLOTS];
+};
+
+static_assert(std::atomic<unsigned long long>::is_always_lock_free, "the broker rings need lock free 64 bit atomics");
+
+int brokerMode = MIDI_BROKER_OFF;
+int brokerRole = MIDI_BROKER_OFF;
+MidiBrokerShared* broker;
+std::vector<MidiBrokerShared*> retiredBrokers; // mappings of terminates that left stuck threads
+int brokerFd = -1;
+std::mutex brokerInputMutex; // the owner's readers publish one at a time
+std::mutex brokerDevicesMutex; // the owner's table updates
+std::atomic<long long> brokerLost;
+std::atomic<long long> brokerSkipped;
+std::atomic<long long> brokerDropped;
+
+void futexWait(std::atomic<unsigned int>* word, unsigned int expected, int timeoutMillis) {
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMillis / 1000;
+    timeout.tv_nsec = (timeoutMillis % 1000) * 1000000L;
+    syscall(SYS_futex, (unsigned int*)word, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+void futexWake(std::atomic<unsigned int>* word, std::atomic<int>* waiters) {
+    word->fetch_add(1);
+    if (waiters->load() > 0) {
+        syscall(SYS_futex, (unsigned int*)word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+// maps the segment and takes the owner role when asked to and nobody else has it
+// the owner holds an flock on the segment, released by the kernel even when the process dies
+bool openBroker(int mode) {
+    // only processes of the same user share the devices, anyone else could inject or crash the owner
+    brokerFd = shm_open(MIDI_BROKER_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (brokerFd < 0) {
+        return false;
+    }
+    // a segment made by another user is refused, one left open by an older version is closed down
+    struct stat status;
+    if (fstat(brokerFd, &status) != 0 || status.st_uid != geteuid() ||
+        ((status.st_mode & 077) != 0 && fchmod(brokerFd, 0600) != 0) ||
+        (status.st_size < (off_t)sizeof(MidiBrokerShared) && ftruncate(brokerFd, sizeof(MidiBrokerShared)) != 0)) {
+        close(brokerFd);
+        brokerFd = -1;
+        return false;
+    }
+    void* memory = mmap(nullptr, sizeof(MidiBrokerShared), PROT_READ | PROT_WRITE, MAP_SHARED, brokerFd, 0);
+    if (memory == MAP_FAILED) {
+        close(brokerFd);
+        brokerFd = -1;
+        return false;
+    }
+    broker = (MidiBrokerShared*)memory;
+
+    if (mode != MIDI_BROKER_CLIENT && flock(brokerFd, LOCK_EX | LOCK_NB) == 0) {
+        brokerRole = MIDI_BROKER_OWNER;
+        broker->magic = 0;
+        broker->version = MIDI_BROKER_VERSION;
+        broker->deviceSequence = 0;
+        broker->deviceCount = 0;
+        memset(broker->devices, 0, sizeof(broker->devices));
+        broker->inputHead = 0;
+        for (int i = 0; i < MIDI_BROKER_INPUT_SLOTS; i++) {
+            broker->input[i].sequence = 0;
+        }
+        broker->outputHead = 0;
+        broker->outputTail = 0;
+        for (int i = 0; i < MIDI_BROKER_OUTPUT_SLOTS; i++) {
+            broker->output[i].sequence = i;
+            broker->output[i].pid = 0;
+        }
+        broker->ownerPid = getpid();
+        broker->epoch.fetch_add(1);
+        broker->magic = MIDI_BROKER_MAGIC;
+        return true;
+    }
+    if (mode == MIDI_BROKER_OWNER) {
+        // another process owns the devices, run on our own
+        munmap(broker, sizeof(MidiBrokerShared));
+        broker = nullptr;
+        close(brokerFd);
+        brokerFd = -1;
+        return false;
+    }
+    brokerRole = MIDI_BROKER_CLIENT;
+    return true;
+}
+
+// gives up the role and the owner lock, so that the next session can take them again
+// isUnmapped is false while stuck threads may still use the mapping, it's then unmapped by the next clean terminate
+void closeBroker(bool isUnmapped) {
+    if (broker == nullptr) {
+        return;
+    }
+    if (brokerRole == MIDI_BROKER_OWNER) {
+        broker->ownerPid = 0;
+        broker->magic = 0;
+        // wake the clients so they notice
+        futexWake(&broker->inputFutex, &broker->inputWaiters);
+    }
+    if (isUnmapped) {
+        munmap(broker, sizeof(MidiBrokerShared));
+    } else {
+        retiredBrokers.push_back(broker);
+    }
+    broker = nullptr;
+    // a kept mapping holds the open file too, so closing alone wouldn't release the owner lock
+    flock(brokerFd, LOCK_UN);
+    close(brokerFd);
+    brokerFd = -1;
+    brokerRole = MIDI_BROKER_OFF;
+}
+
+bool isBrokerOwnerAlive() {
+    if (broker->magic.load() != MIDI_BROKER_MAGIC || broker->version != MIDI_BROKER_VERSION) {
+        return false;
+    }
+    int pid = broker->ownerPid.load();
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// the table index of the device, -1 when it isn't published
+int findBrokerDevice(const char* deviceId) {
+    for (int i = 0; i < broker->deviceCount; i++) {
+        if (strcmp(broker->devices[i].id, deviceId) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// owner: the rawmidi and UMP devices of the registry, after each change
+void publishBrokerDevices(const MidiDeviceRegistry* registry) {
+    std::lock_guard<std::mutex> lock(brokerDevicesMutex);
+    broker->deviceSequence.fetch_add(1);
+    for (int i = 0; i < broker->deviceCount; i++) {
+        broker->devices[i].directions = 0;
+    }
+    for (decltype(registry->devices)::const_iterator it = registry->devices.begin(); it != registry->devices.end(); ++it) {
+        const MidiDevice& device = it->second;
+        if ((device.capabilities & (MIDI_CAPABILITY_RAWMIDI | MIDI_CAPABILITY_UMP)) == 0 || device.id.size() >= sizeof(broker->devices[0].id)) {
+            continue;
+        }
+        int index = findBrokerDevice(device.id.c_str());
+        if (index < 0) {
+            if (broker->deviceCount == MIDI_BROKER_DEVICES) {
+                continue;
+            }
+            index = broker->deviceCount++;
+            snprintf(broker->devices[index].id, sizeof(broker->devices[index].id), "%s", device.id.c_str());
+        }
+        snprintf(broker->devices[index].name, sizeof(broker->devices[index].name), "%s", device.name.c_str());
+        broker->devices[index].directions = device.directions;
+        broker->devices[index].capabilities = device.capabilities;
+    }
+    broker->deviceSequence.fetch_add(1);
+}
+
+// client: consistent copy of the table, returns the device count
+int readBrokerDevices(MidiBrokerDevice* devices) {
+    while (true) {
+        unsigned int sequence = broker->deviceSequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        int count = std::min(broker->deviceCount, MIDI_BROKER_DEVICES);
+        memcpy(devices, broker->devices, count * sizeof(MidiBrokerDevice));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (broker->deviceSequence.load(std::memory_order_relaxed) == sequence) {
+            return count;
+        }
+    }
+}
+
+// owner: bytes read from a device, index from findBrokerDevice
+void publishBrokerInput(int index, const unsigned char* data, size_t length) {
+    std::lock_guard<std::mutex> lock(brokerInputMutex);
+    while (length > 0) {
+        unsigned long long position = broker->inputHead.load(std::memory_order_relaxed);
+        MidiBrokerInputSlot& slot = broker->input[position % MIDI_BROKER_INPUT_SLOTS];
+        size_t chunk = std::min(length, sizeof(slot.data));
+        slot.sequence.store(2 * position + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.device = index;
+        slot.length = chunk;
+        memcpy(slot.data, data, chunk);
+        slot.sequence.store(2 * position + 2, std::memory_order_release);
+        broker->inputHead.store(position + 1, std::memory_order_release);
+        data += chunk;
+        length -= chunk;
+    }
+    futexWake(&broker->inputFutex, &broker->inputWaiters);
+}
+
+// client: a message goes into consecutive slots, so messages of different clients never interleave
+void writeBrokerOutput(int index, const unsigned char* data, size_t length) {
+    if (broker == nullptr || length == 0) {
+        return;
+    }
+    size_t slotCount = (length + sizeof(broker->output[0].data) - 1) / sizeof(broker->output[0].data);
+    if (slotCount > MIDI_BROKER_OUTPUT_SLOTS) {
+        brokerDropped++;
+        return;
+    }
+
+    unsigned int position = broker->outputHead.load(std::memory_order_relaxed);
+    while (true) {
+        // the owner frees in order, so the last slot being free means they all are
+        MidiBrokerOutputSlot& last = broker->output[(position + slotCount - 1) % MIDI_BROKER_OUTPUT_SLOTS];
+        int difference = (int)(last.sequence.load(std::memory_order_acquire) - (position + slotCount - 1));
+        if (difference == 0) {
+            if (broker->outputHead.compare_exchange_weak(position, position + slotCount, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // full, the owner is gone or stuck
+            brokerDropped++;
+            return;
+        } else {
+            position = broker->outputHead.load(std::memory_order_relaxed);
+        }
+    }
+
+    // each slot is claimed before it is touched: once the owner skipped a stale reservation, the slot may
+    // already belong to another client
+    int pid = getpid();
+    for (size_t i = 0; i < slotCount; i++) {
+        MidiBrokerOutputSlot& slot = broker->output[(position + i) % MIDI_BROKER_OUTPUT_SLOTS];
+        unsigned int expected = position + i;
+        if (!slot.sequence.compare_exchange_strong(expected, position + i + MIDI_BROKER_CLAIMED, std::memory_order_acquire)) {
+            // stalled past MIDI_BROKER_STALE_NANOS and skipped, the owner skips the rest of the reservation too
+            break;
+        }
+        // so that the owner can tell a dead client's slot from a slow one
+        slot.pid.store(pid, std::memory_order_relaxed);
+        size_t chunk = std::min(length, sizeof(slot.data));
+        slot.device = index;
+        slot.length = chunk;
+        memcpy(slot.data, data, chunk);
+        slot.sequence.store(position + i + 1, std::memory_order_release);
+        data += chunk;
+        length -= chunk;
+    }
+    futexWake(&broker->outputFutex, &broker->outputWaiters);
+}
+
+// owner: writes what the clients submitted
+void brokerOutputWatcher() {
+    configureCurrentThread(MIDI_THREAD_CONNECTION, "midi-broker-out");
+    ioThreadStarted();
+    // the mapping stays valid until every thread that was started with it has ended, see closeBroker
+    MidiBrokerShared* shared = broker;
+
+    long long waitingSince = 0; // when the tail was first seen reserved but not filled
+    unsigned int waitingHead = 0; // the head then, the slots before it were reserved at least that long ago
+    unsigned int staleHead = shared->outputTail; // after a stale skip, unclaimed slots before it are stale too
+    while (!isStopped && broker == shared) {
+        unsigned int tail = shared->outputTail;
+        if ((int)(staleHead - tail) < 0) {
+            // past the stale slots, kept at the tail so that the comparison stays in range
+            staleHead = tail;
+        }
+        MidiBrokerOutputSlot& slot = shared->output[tail % MIDI_BROKER_OUTPUT_SLOTS];
+        unsigned int sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != tail + 1) {
+            unsigned int head = shared->outputHead.load(std::memory_order_acquire);
+            if ((int)(head - tail) > 0) {
+                // reserved: a client that died, or stalled this long, would block every client behind it
+                long long now = currentTimestamp();
+                if (waitingSince == 0) {
+                    waitingSince = now;
+                    waitingHead = head;
+                }
+                bool isWaitedOut = now - waitingSince > MIDI_BROKER_STALE_NANOS;
+                bool isSkipped;
+                if (sequence == tail + MIDI_BROKER_CLAIMED) {
+                    // the client writes its pid right after the claim, so a missing one means it died in between
+                    int pid = slot.pid.load(std::memory_order_relaxed);
+                    isSkipped = pid != 0 ? kill(pid, 0) != 0 && errno == ESRCH : isWaitedOut;
+                } else {
+                    isSkipped = isWaitedOut || (int)(staleHead - tail) > 0;
+                }
+                if (isSkipped) {
+                    // cleared first, a client that claims the slot meanwhile writes its own
+                    slot.pid.store(0, std::memory_order_relaxed);
+                    unsigned int expected = sequence;
+                    if (slot.sequence.compare_exchange_strong(expected, tail + MIDI_BROKER_OUTPUT_SLOTS, std::memory_order_acq_rel)) {
+                        if (isWaitedOut) {
+                            staleHead = waitingHead;
+                        }
+                        shared->outputTail = tail + 1;
+                        brokerSkipped++;
+                        waitingSince = 0;
+                        continue;
+                    }
+                }
+            }
+            unsigned int futex = shared->outputFutex.load();
+            shared->outputWaiters.fetch_add(1);
+            if (slot.sequence.load(std::memory_order_acquire) != tail + 1 && !isStopped) {
+                futexWait(&shared->outputFutex, futex, MIDI_BROKER_WAIT_MILLIS);
+            }
+            shared->outputWaiters.fetch_sub(1);
+            continue;
+        }
+
+        // the segment is writable by every client, so nothing in it is trusted
+        unsigned short index = slot.device;
+        size_t length = std::min<size_t>(slot.length, sizeof(slot.data));
+        if (length > 0 && index < std::min(shared->deviceCount, MIDI_BROKER_DEVICES)) {
+            char deviceId[sizeof(shared->devices[0].id)];
+            memcpy(deviceId, shared->devices[index].id, sizeof(deviceId));
+            deviceId[sizeof(deviceId) - 1] = '\0';
+            MidiReadSection section;
+            const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT);
+            if (device != nullptr && device->output) {
+                writeMidiOutput(device, slot.data, length);
+            }
+        }
+        slot.pid.store(0, std::memory_order_relaxed);
+        slot.sequence.store(tail + MIDI_BROKER_OUTPUT_SLOTS, std::memory_order_release);
+        shared->outputTail = tail + 1;
+        waitingSince = 0;
+    }
+}
+
+// latency probes: F0 7D 4C <28 bit sequence number> F7, 7D is the non-commercial manufacturer id
+// the readers take them out of the stream while a test runs, so consumers never see them
+#define MIDI_LATENCY_PROBE_LENGTH 8
+
+struct MidiLatencyTest {
+    int inputHandle;    // 0 when the input isn't a listed device
+    std::string inputId;
+    std::vector<long long> sent;     // by sequence number
+    std::vector<long long> received; // 0 until the probe came back
+    std::atomic<int> receivedCount;
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+std::atomic<MidiLatencyTest*> activeLatencyTest;
+std::atomic<int> latencyTestUsers; // readers inside consumeLatencyProbe
+std::mutex latencyTestMutex; // one test at a time
+
+void encodeLatencyProbe(unsigned int sequence, unsigned char* probe) {
+    probe[0] = 0xf0;
+    probe[1] = 0x7d;
+    probe[2] = 0x4c;
+    probe[3] = (sequence >> 21) & 0x7f;
+    probe[4] = (sequence >> 14) & 0x7f;
+    probe[5] = (sequence >> 7) & 0x7f;
+    probe[6] = sequence & 0x7f;
+    probe[7] = 0xf7;
+}
+
+// matches the input by handle, or by deviceId for sequencer ports that aren't listed
+// returns true when the message was a probe of the running test
+bool consumeLatencyProbe(int handle, const char* deviceId, const unsigned char* data, size_t length) {
+    if (activeLatencyTest.load(std::memory_order_relaxed) == nullptr) {
+        return false;
+    }
+    if (length != MIDI_LATENCY_PROBE_LENGTH || data[1] != 0x7d || data[2] != 0x4c) {
+        return false;
+    }
+    long long timestamp = currentTimestamp();
+
+    latencyTestUsers.fetch_add(1);
+    MidiLatencyTest* test = activeLatencyTest.load();
+    bool consumed = false;
+    if (test != nullptr && (deviceId != nullptr ? test->inputId == deviceId : handle == test->inputHandle)) {
+        unsigned int sequence = (data[3] << 21) | (data[4] << 14) | (data[5] << 7) | data[6];
+        if (sequence < test->received.size() && test->received[sequence] == 0) {
+            test->received[sequence] = timestamp;
+            if (test->receivedCount.fetch_add(1) + 1 == (int)test->received.size()) {
+                std::lock_guard<std::mutex> lock(test->mutex);
+                test->condition.notify_all();
+            }
+        }
+        consumed = true;
+    }
+    latencyTestUsers.fetch_sub(1);
+    return consumed;
+}
+
+// capture file: "MIDICAP" and a version byte, then records
+//   device: type 1, u16 index, u8 flags, u8 id length, id, u8 name length, name
+//   bytes:  type 2, u16 index, u32 microseconds since the previous record, u16 length, bytes
+// integers are little endian, indexes are local to the file
+#define MIDI_CAPTURE_MAGIC "MIDICAP\x01"
+#define MIDI_CAPTURE_DEVICE 1
+#define MIDI_CAPTURE_BYTES  2
+#define MIDI_CAPTURE_SEQUENCER 1 // device flag, the bytes came from sequencer events
+#define MIDI_CAPTURE_BUFFER_SIZE (256 * 1024)
+
+#define MIDI_CAPTURE_STAGES 32
+#define MIDI_CAPTURE_STAGE_SIZE (64 * 1024)
+#define MIDI_CAPTURE_INTERVAL std::chrono::milliseconds(10)
+
+// staged record: u32 session, u32 handle, u8 flags, u8 id length, u64 timestamp, u32 length, id, bytes
+#define MIDI_CAPTURE_STAGE_HEADER 22
+
+// stage states
+#define MIDI_CAPTURE_UNUSED   0
+#define MIDI_CAPTURE_OWNED    1
+#define MIDI_CAPTURE_FINISHED 2
+
+// every reader thread stages its records in its own ring, claimed from a pool the first time it captures,
+// and the writer thread collects the rings every MIDI_CAPTURE_INTERVAL
+// a reader never locks, allocates or waits for the disk, a record that doesn't fit its ring is dropped
+struct MidiCaptureStage {
+    std::atomic<int> state; // MIDI_CAPTURE_*, changed under captureStagesMutex except by the owner when it ends
+    std::atomic<unsigned long long> head; // written by the owner thread only
+    std::atomic<unsigned long long> tail; // written by the capture writer only
+    unsigned char bytes[MIDI_CAPTURE_STAGE_SIZE];
+};
+
+struct MidiCapture {
+    FILE* file;
+    bool isStopping;
+    std::vector<int> deviceHandles; // by file index
+    long long lastTimestamp;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+MidiCapture midiCapture;
+std::atomic<bool> isCapturing;
+std::atomic<long long> captureDropped;
+std::mutex captureControlMutex;
+// records staged by a reader that was still appending when its capture stopped are skipped by the next one
+std::atomic<unsigned int> captureSession;
+// MIDI_CAPTURE_STAGES of them, never freed since the threads keep pointers into it
+std::atomic<MidiCaptureStage*> captureStages;
+std::mutex captureStagesMutex; // claims
+
+// marks the stage of the thread when the thread ends
+struct MidiCaptureThread {
+    MidiCaptureStage* stage;
+    ~MidiCaptureThread() {
+        if (stage != nullptr) {
+            stage->state = MIDI_CAPTURE_FINISHED;
+        }
+    }
+};
+
+thread_local MidiCaptureThread captureThread;
+
+// claims an unused stage for the thread, else the one of a finished thread
+// nullptr when every stage is owned, the bytes are dropped then
+MidiCaptureStage* currentCaptureStage() {
+    if (captureThread.stage != nullptr) {
+        return captureThread.stage;
+    }
+    MidiCaptureStage* stages = captureStages.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(captureStagesMutex, std::try_to_lock);
+    if (stages == nullptr || !lock.owns_lock()) {
+        return nullptr;
+    }
+
+    MidiCaptureStage* stage = nullptr;
+    for (int i = 0; i < MIDI_CAPTURE_STAGES && stage == nullptr; i++) {
+        if (stages[i].state == MIDI_CAPTURE_UNUSED) {
+            stage = &stages[i];
+        }
+    }
+    for (int i = 0; i < MIDI_CAPTURE_STAGES && stage == nullptr; i++) {
+        if (stages[i].state == MIDI_CAPTURE_FINISHED) {
+            stage = &stages[i];
+        }
+    }
+    if (stage == nullptr) {
+        return nullptr;
+    }
+    // records left by the finished owner are still collected, the ring just changes hands
+    stage->state = MIDI_CAPTURE_OWNED;
+    captureThread.stage = stage;
+    return stage;
+}
+
+void copyToCaptureStage(MidiCaptureStage* stage, unsigned long long position, const unsigned char* data, size_t length) {
+    size_t offset = position % MIDI_CAPTURE_STAGE_SIZE;
+    size_t first = std::min<size_t>(length, MIDI_CAPTURE_STAGE_SIZE - offset);
+    memcpy(stage->bytes + offset, data, first);
+    memcpy(stage->bytes, data + first, length - first);
+}
+
+void copyFromCaptureStage(const MidiCaptureStage* stage, unsigned long long position, unsigned char* data, size_t length) {
+    size_t offset = position % MIDI_CAPTURE_STAGE_SIZE;
+    size_t first = std::min<size_t>(length, MIDI_CAPTURE_STAGE_SIZE - offset);
+    memcpy(data, stage->bytes + offset, first);
+    memcpy(data + first, stage->bytes, length - first);
+}
+
+void appendCaptureInteger(std::vector<unsigned char>& buffer, unsigned int value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        buffer.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+void writeCaptureInteger(unsigned char* data, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        data[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+unsigned long long readCaptureLong(const unsigned char* data, int bytes) {
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (unsigned long long)data[i] << (8 * i);
+    }
+    return value;
+}
+
+// a record collected from a stage, its id and bytes are in the staged buffer of the writer
+struct MidiCaptureRecord {
+    long long timestamp;
+    int handle;
+    bool isSequencer;
+    size_t id;
+    size_t idLength;
+    size_t data;
+    size_t length;
+};
+
+// only the writer thread touches the file records
+int captureDeviceIndex(int handle, const char* deviceId, size_t idLength, bool isSequencer, std::vector<unsigned char>& buffer) {
+    for (size_t i = 0; i < midiCapture.deviceHandles.size(); i++) {
+        if (midiCapture.deviceHandles[i] == handle) {
+            return i;
+        }
+    }
+
+    std::string id(deviceId, idLength);
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(id.c_str(), MIDI_DIRECTION_INPUT);
+    const char* name = device != nullptr ? device->name.c_str() : "";
+    size_t nameLength = std::min<size_t>(strlen(name), 255);
+
+    int index = midiCapture.deviceHandles.size();
+    buffer.push_back(MIDI_CAPTURE_DEVICE);
+    appendCaptureInteger(buffer, index, 2);
+    buffer.push_back(isSequencer ? MIDI_CAPTURE_SEQUENCER : 0);
+    buffer.push_back(idLength);
+    buffer.insert(buffer.end(), deviceId, deviceId + idLength);
+    buffer.push_back(nameLength);
+    buffer.insert(buffer.end(), name, name + nameLength);
+    midiCapture.deviceHandles.push_back(handle);
+    return index;
+}
+
+// moves the records of every stage to the staged buffer, skipping the ones of an earlier capture
+void collectCaptureStages(unsigned int session, std::vector<unsigned char>& staged, std::vector<MidiCaptureRecord>& records) {
+    MidiCaptureStage* stages = captureStages.load(std::memory_order_acquire);
+    for (int i = 0; stages != nullptr && i < MIDI_CAPTURE_STAGES; i++) {
+        MidiCaptureStage* stage = &stages[i];
+        unsigned long long tail = stage->tail.load(std::memory_order_relaxed);
+        unsigned long long head = stage->head.load(std::memory_order_acquire);
+        while (tail < head) {
+            unsigned char header[MIDI_CAPTURE_STAGE_HEADER];
+            copyFromCaptureStage(stage, tail, header, MIDI_CAPTURE_STAGE_HEADER);
+            MidiCaptureRecord record;
+            record.handle = readCaptureLong(header + 4, 4);
+            record.isSequencer = header[8] & MIDI_CAPTURE_SEQUENCER;
+            record.idLength = header[9];
+            record.timestamp = readCaptureLong(header + 10, 8);
+            record.length = readCaptureLong(header + 18, 4);
+            size_t recordLength = MIDI_CAPTURE_STAGE_HEADER + record.idLength + record.length;
+            if (readCaptureLong(header, 4) == session) {
+                record.id = staged.size();
+                record.data = record.id + record.idLength;
+                staged.resize(staged.size() + record.idLength + record.length);
+                copyFromCaptureStage(stage, tail + MIDI_CAPTURE_STAGE_HEADER, staged.data() + record.id,
+                    record.idLength + record.length);
+                records.push_back(record);
+            }
+            tail += recordLength;
+        }
+        stage->tail.store(tail, std::memory_order_release);
+    }
+}
+
+void captureWriter(unsigned int session) {
+    std::vector<unsigned char> staged;
+    std::vector<MidiCaptureRecord> records;
+    std::vector<unsigned char> buffer;
+    buffer.reserve(MIDI_CAPTURE_BUFFER_SIZE);
+    bool isStopping = false;
+    while (!isStopping) {
+        {
+            std::unique_lock<std::mutex> lock(midiCapture.mutex);
+            midiCapture.condition.wait_for(lock, MIDI_CAPTURE_INTERVAL, [] { return midiCapture.isStopping; });
+            // the last collection once stopping, a record staged after it is skipped by the next capture
+            isStopping = midiCapture.isStopping;
+        }
+
+        staged.clear();
+        records.clear();
+        collectCaptureStages(session, staged, records);
+        // the stages interleave by time, a record staged after an earlier collection has a zero delta
+        std::stable_sort(records.begin(), records.end(), [](const MidiCaptureRecord& a, const MidiCaptureRecord& b) {
+            return a.timestamp < b.timestamp;
+        });
+        for (size_t i = 0; i < records.size(); i++) {
+            const MidiCaptureRecord& record = records[i];
+            const unsigned char* data = staged.data() + record.data;
+            size_t length = record.length;
+            int index = captureDeviceIndex(record.handle, (const char*)staged.data() + record.id, record.idLength,
+                record.isSequencer, buffer);
+            long long delta = midiCapture.lastTimestamp == 0 ? 0 : (record.timestamp - midiCapture.lastTimestamp) / 1000;
+            midiCapture.lastTimestamp = std::max(midiCapture.lastTimestamp, record.timestamp);
+            delta = std::max(delta, 0LL);
+            while (length > 0) {
+                size_t chunk = std::min<size_t>(length, 0xffff);
+                buffer.push_back(MIDI_CAPTURE_BYTES);
+                appendCaptureInteger(buffer, index, 2);
+                appendCaptureInteger(buffer, std::min<long long>(delta, 0xffffffff), 4);
+                appendCaptureInteger(buffer, chunk, 2);
+                buffer.insert(buffer.end(), data, data + chunk);
+                data += chunk;
+                length -= chunk;
+                delta = 0;
+            }
+            if (buffer.size() >= MIDI_CAPTURE_BUFFER_SIZE) {
+                fwrite(buffer.data(), 1, buffer.size(), midiCapture.file);
+                buffer.clear();
+            }
+        }
+        fwrite(buffer.data(), 1, buffer.size(), midiCapture.file);
+        buffer.clear();
+    }
+}
+
+void captureMidiBytes(int handle, long long timestamp, const char* deviceId, bool isSequencer, const unsigned char* data, size_t length) {
+    if (!isCapturing.load(std::memory_order_relaxed) || length == 0) {
+        return;
+    }
+    MidiCaptureStage* stage = currentCaptureStage();
+    size_t idLength = std::min<size_t>(strlen(deviceId), 255);
+    size_t recordLength = MIDI_CAPTURE_STAGE_HEADER + idLength + length;
+    if (stage == nullptr) {
+        captureDropped += length;
+        return;
+    }
+    unsigned long long head = stage->head.load(std::memory_order_relaxed);
+    if (head - stage->tail.load(std::memory_order_acquire) + recordLength > MIDI_CAPTURE_STAGE_SIZE) {
+        captureDropped += length;
+        return;
+    }
+
+    unsigned char header[MIDI_CAPTURE_STAGE_HEADER];
+    writeCaptureInteger(header, captureSession.load(std::memory_order_relaxed), 4);
+    writeCaptureInteger(header + 4, handle, 4);
+    header[8] = isSequencer ? MIDI_CAPTURE_SEQUENCER : 0;
+    header[9] = idLength;
+    writeCaptureInteger(header + 10, timestamp, 8);
+    writeCaptureInteger(header + 18, length, 4);
+    copyToCaptureStage(stage, head, header, MIDI_CAPTURE_STAGE_HEADER);
+    copyToCaptureStage(stage, head + MIDI_CAPTURE_STAGE_HEADER, (const unsigned char*)deviceId, idLength);
+    copyToCaptureStage(stage, head + MIDI_CAPTURE_STAGE_HEADER + idLength, data, length);
+    stage->head.store(head + recordLength, std::memory_order_release);
+}
+
+void virtualMidiEventWatcher() {
+    snd_seq_event_t *ev = nullptr;
+    char deviceId[32];
+
+    configureCurrentThread(MIDI_THREAD_INPUT, "midi-seq-in");
+    ioThreadStarted();
+
+    struct pollfd descriptors[MAX_POLL_DESCRIPTORS];
+    int descriptorCount = snd_seq_poll_descriptors(seq_handle, descriptors, MAX_POLL_DESCRIPTORS - 1, POLLIN);
+    descriptors[descriptorCount].fd = wakeupFd;
+    descriptors[descriptorCount].events = POLLIN;
+
+    while (!isStopped && seq_handle != nullptr) {
+        if (snd_seq_event_input_pending(seq_handle, 0) == 0) {
+            // nothing buffered, wait for the kernel or for TerminateMidiLinux
+            int result = poll(descriptors, descriptorCount + 1, -1);
+            if (result < 0 && errno != EINTR) {
+                break;
+            }
+            if (isStopped || descriptors[descriptorCount].revents) {
+                break;
+            }
+            if (result <= 0) {
+                continue;
+            }
+        }
+        int result;
+        {
+            MIDI_TRACE_SPAN("read");
+            result = snd_seq_event_input(seq_handle, &ev);
+        }
+        if (result == -ENOSPC) {
+            // the kernel input pool overran, events were lost
+            countInputResync(nullptr);
+        }
+        if (result < 0 || ev == nullptr) {
+            continue;
+        }
+
+        sprintf(deviceId, "seq:%d-%d", ev->source.client, ev->source.port);
+        MidiReadSection section;
+        const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_INPUT);
+        if (device == nullptr) {
+            // ignore if not connected, unless it's the input of a latency test
+            if (ev->type == SND_SEQ_EVENT_SYSEX) {
+                consumeLatencyProbe(0, deviceId, (const unsigned char *)ev->data.ext.ptr, ev->data.ext.len);
+            }
+            continue;
+        }
+        int handle = device->handle;
+        long long timestamp = currentTimestamp();
+
+        if (ev->type == SND_SEQ_EVENT_SYSEX) {
+            if (consumeLatencyProbe(handle, nullptr, (const unsigned char *)ev->data.ext.ptr, ev->data.ext.len)) {
+                continue;
+            }
+            captureMidiBytes(handle, timestamp, deviceId, true, (const unsigned char *)ev->data.ext.ptr, ev->data.ext.len);
+            dispatchSystemExclusive(handle, timestamp, (const unsigned char *)ev->data.ext.ptr, ev->data.ext.len, true);
+            enqueueSystemExclusive(device->queue.get(), timestamp, (const unsigned char *)ev->data.ext.ptr, ev->data.ext.len);
+            continue;
+        }
+
+        // https://www.alsa-project.org/alsa-doc/alsa-lib/group___seq_events.html#gaef39e1f267006faf7abc91c3cb32ea40
+        unsigned char data1;
+        unsigned char data2;
+        unsigned char status = decodeSequencerEvent(ev, &data1, &data2);
+        if (status == 0) {
+            continue;
+        }
+        if (isCapturing.load(std::memory_order_relaxed)) {
+            unsigned char bytes[3] = {status, data1, data2};
+            captureMidiBytes(handle, timestamp, deviceId, true, bytes, midiMessageLength(status));
+        }
+        dispatchMidiMessage(handle, timestamp, status, data1, data2, true);
+        enqueueMidiMessage(device->queue.get(), timestamp, status, data1, data2);
+    }
+}
+
+// MIDI 1.0 byte stream parser states
+#define MIDI_STATE_WAIT            0
+#define MIDI_STATE_SIGNAL_2BYTES_2 21
+#define MIDI_STATE_SIGNAL_3BYTES_2 31
+#define MIDI_STATE_SIGNAL_3BYTES_3 32
+#define MIDI_STATE_SIGNAL_SYSEX    41
+
+// state of one MIDI 1.0 byte stream, kept across reads
+struct MidiParser {
+    int handle;
+    bool fromUmp; // the stream was translated from UMP packets, which were already delivered as such
+    MidiInputQueue* queue; // nullptr to skip the message callback
+    unsigned char midiEventKind; // running status, 0 when there is none
+    unsigned char midiEventNote;
+    int midiState;
+    std::vector<unsigned char>* systemExclusiveStream;
+    long long timestamp; // of the read being parsed, shared by its messages
+};
+
+// the sysex buffer comes from the arena of the calling thread
+void initializeMidiParser(MidiParser& parser, int handle, bool fromUmp, MidiInputQueue* queue) {
+    parser.handle = handle;
+    parser.fromUmp = fromUmp;
+    parser.queue = queue;
+    parser.midiEventKind = 0;
+    parser.midiEventNote = 0;
+    parser.midiState = MIDI_STATE_WAIT;
+    parser.systemExclusiveStream = &ioArena.systemExclusiveStream;
+    parser.timestamp = 0;
+}
+
+// forgets the partial message
+void clearMidiParser(MidiParser& parser) {
+    parser.midiEventKind = 0;
+    parser.midiState = MIDI_STATE_WAIT;
+    parser.systemExclusiveStream->clear();
+}
+
+// after bytes were lost
+void resetMidiParser(MidiParser& parser) {
+    clearMidiParser(parser);
+    countInputResync(parser.queue);
+}
+
+void emitMidiMessage(MidiParser& parser, unsigned char status, unsigned char data1, unsigned char data2) {
+    dispatchMidiMessage(parser.handle, parser.timestamp, status, data1, data2, !parser.fromUmp);
+    if (parser.queue != nullptr) {
+        enqueueMidiMessage(parser.queue, parser.timestamp, status, data1, data2);
+    }
+}
+
+// timestamp is when the bytes were read
+void parseMidi(MidiParser& parser, long long timestamp, const unsigned char* buffer, size_t length) {
+    MIDI_TRACE_SPAN("parse");
+    MIDI_TRACE_ARGUMENT(length);
+    parser.timestamp = timestamp;
+    unsigned char& midiEventKind = parser.midiEventKind;
+    unsigned char& midiEventNote = parser.midiEventNote;
+    int& midiState = parser.midiState;
+    std::vector<unsigned char>& systemExclusiveStream = *parser.systemExclusiveStream;
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char midiEvent = buffer[i];
+
+        if (midiEvent >= 0xf8) {
+            // real time messages may appear anywhere, even inside other messages
+            if (midiEvent != 0xf9 && midiEvent != 0xfd) {
+                emitMidiMessage(parser, midiEvent, 0, 0);
+            }
+            continue;
+        }
+
+        if (midiEvent & 0x80) {
+            if (midiState == MIDI_STATE_SIGNAL_SYSEX && midiEvent == 0xf7) {
+                // the end of message
+                systemExclusiveStream.push_back(midiEvent);
+                if (!consumeLatencyProbe(parser.handle, nullptr, systemExclusiveStream.data(), systemExclusiveStream.size())) {
+                    dispatchSystemExclusive(parser.handle, parser.timestamp, systemExclusiveStream.data(), systemExclusiveStream.size(), !parser.fromUmp);
+                    if (parser.queue != nullptr) {
+                        enqueueSystemExclusive(parser.queue, parser.timestamp, systemExclusiveStream.data(), systemExclusiveStream.size());
+                    }
+                }
+                systemExclusiveStream.clear();
+                midiState = MIDI_STATE_WAIT;
+                continue;
+            }
+            if (midiState != MIDI_STATE_WAIT) {
+                // a status byte inside a message: its remaining bytes were lost, start over from this one
+                resetMidiParser(parser);
+            }
+
+            // system common messages cancel the running status
+            midiEventKind = 0;
+            if (midiEvent == 0xf0) {
+                systemExclusiveStream.clear();
+                systemExclusiveStream.push_back(midiEvent);
+                midiState = MIDI_STATE_SIGNAL_SYSEX;
+                continue;
+            }
+            switch (midiMessageKind(midiEvent).length) {
+                case 3:
+                    midiEventKind = midiEvent;
+                    midiState = MIDI_STATE_SIGNAL_3BYTES_2;
+                    break;
+                case 2:
+                    midiEventKind = midiEvent;
+                    midiState = MIDI_STATE_SIGNAL_2BYTES_2;
+                    break;
+                case 1:
+                    emitMidiMessage(parser, midiEvent, 0, 0);
+                    break;
+                default:
+                    // undefined, or 0xf7 without a message
+                    break;
+            }
+            continue;
+        }
+
+        // data bytes
+        switch (midiState) {
+            case MIDI_STATE_WAIT:
+                // running status: the previous channel message kind
+                if (midiEventKind != 0 && midiEventKind < 0xf0) {
+                    if (midiMessageKind(midiEventKind).length == 2) {
+                        emitMidiMessage(parser, midiEventKind, midiEvent, 0);
+                    } else {
+                        midiEventNote = midiEvent;
+                        midiState = MIDI_STATE_SIGNAL_3BYTES_3;
+                    }
+                }
+                break;
+            case MIDI_STATE_SIGNAL_2BYTES_2:
+                emitMidiMessage(parser, midiEventKind, midiEvent, 0);
+                if (midiEventKind >= 0xf0) {
+                    midiEventKind = 0;
+                }
+                midiState = MIDI_STATE_WAIT;
+                break;
+            case MIDI_STATE_SIGNAL_3BYTES_2:
+                midiEventNote = midiEvent;
+                midiState = MIDI_STATE_SIGNAL_3BYTES_3;
+                break;
+            case MIDI_STATE_SIGNAL_3BYTES_3:
+                emitMidiMessage(parser, midiEventKind, midiEventNote, midiEvent);
+                if (midiEventKind >= 0xf0) {
+                    midiEventKind = 0;
+                }
+                midiState = MIDI_STATE_WAIT;
+                break;
+            case MIDI_STATE_SIGNAL_SYSEX:
+                systemExclusiveStream.push_back(midiEvent);
+                break;
+        }
+    }
+}
+
+// the in-process loopback parses what is written on the writer's thread, under the output port mutex
+struct MidiLoopback {
+    MidiParser parser;
+    std::vector<unsigned char> systemExclusiveStream; // the writers' arenas can't be shared
+    std::shared_ptr<MidiInputQueue> queue;
+};
+
+#define MIDI_LOOPBACK_ID "loop:0"
+std::atomic<bool> isLoopbackEnabled;
+
+std::shared_ptr<MidiLoopback> openLoopback(int handle, std::shared_ptr<MidiInputQueue> queue) {
+    std::shared_ptr<MidiLoopback> loopback = std::make_shared<MidiLoopback>();
+    initializeMidiParser(loopback->parser, handle, false, queue.get());
+    loopback->systemExclusiveStream.reserve(IO_ARENA_SYSEX_RESERVE);
+    loopback->parser.systemExclusiveStream = &loopback->systemExclusiveStream;
+    loopback->queue = queue;
+    return loopback;
+}
+
+void writeLoopback(MidiLoopback* loopback, const unsigned char* data, size_t length) {
+    parseMidi(loopback->parser, currentTimestamp(), data, length);
+}
+
+// consecutive read errors before the device is given up, the next scan then reopens it
+#define MIDI_INPUT_MAX_ERRORS 10
+
+// one rawmidi input, read by its own thread or by a shard
+struct MidiRawmidiReader {
+    std::string deviceId;
+    int handle;
+    std::shared_ptr<MidiInputPort> port;
+    std::shared_ptr<MidiInputQueue> queue;
+    MidiParser parser;
+    std::vector<unsigned char> systemExclusiveStream; // shards read several devices, which can't share the arena
+    int errors;
+    int brokerIndex; // published by the connection watcher once the device is listed
+    size_t firstDescriptor; // shards only
+    int descriptorCount;
+};
+
+void openRawmidiReader(MidiRawmidiReader& reader, const std::string& deviceId, int handle, std::shared_ptr<MidiInputPort> port, std::shared_ptr<MidiInputQueue> queue, bool isSharded) {
+    reader.deviceId = deviceId;
+    reader.handle = handle;
+    reader.port = port;
+    reader.queue = queue;
+    initializeMidiParser(reader.parser, handle, false, queue.get());
+    if (isSharded) {
+        reader.systemExclusiveStream.reserve(IO_ARENA_SYSEX_RESERVE);
+        reader.parser.systemExclusiveStream = &reader.systemExclusiveStream;
+    }
+    reader.errors = 0;
+    reader.brokerIndex = -1;
+    reader.firstDescriptor = 0;
+    reader.descriptorCount = 0;
+}
+
+// reads what is available, returns false once the device is gone or keeps failing
+// stopFd is slept on after a read error, -1 not to sleep
+bool readRawmidiInput(MidiRawmidiReader& reader, int stopFd) {
+    snd_rawmidi_t* midiInput = reader.port->handle;
+    const char* deviceId = reader.deviceId.c_str();
+    unsigned char buffer[1024];
+    ssize_t read;
+    {
+        MIDI_TRACE_SPAN("read");
+        read = snd_rawmidi_read(midiInput, buffer, sizeof(buffer));
+        MIDI_TRACE_ARGUMENT(read);
+    }
+    if (read == -EAGAIN) {
+        return true;
+    }
+    if (read == -ENODEV || read == -EBADFD) {
+        // unplugged, the next scan detaches it
+        return false;
+    }
+    if (read < 0) {
+        // -EIO or an overrun: bytes were lost, resynchronize on the next status byte
+        resetMidiParser(reader.parser);
+        snd_rawmidi_status_t* status;
+        snd_rawmidi_status_alloca(&status);
+        snd_rawmidi_status(midiInput, status); // also clears the overrun
+        if (++reader.errors > MIDI_INPUT_MAX_ERRORS || (stopFd >= 0 && sleepUntilStopped(stopFd, 10))) {
+            return false;
+        }
+        return true;
+    }
+    reader.errors = 0;
+
+    if (read > 0) {
+        long long timestamp = currentTimestamp();
+        captureMidiBytes(reader.handle, timestamp, deviceId, false, buffer, read);
+        if (brokerRole == MIDI_BROKER_OWNER) {
+            if (reader.brokerIndex < 0) {
+                reader.brokerIndex = findBrokerDevice(deviceId);
+            }
+            if (reader.brokerIndex >= 0) {
+                publishBrokerInput(reader.brokerIndex, buffer, read);
+            }
+        }
+        parseMidi(reader.parser, timestamp, buffer, read);
+    }
+    return true;
+}
+
+// the reader owns its handle
+void closeRawmidiReader(MidiRawmidiReader& reader) {
+    {
+        std::lock_guard<std::mutex> lock(reader.port->mutex);
+        snd_rawmidi_close(reader.port->handle);
+        reader.port->handle = nullptr;
+    }
+    reader.port->closed = true;
+}
+
+void midiEventWatcher(std::string deviceIdStr, int handle, std::shared_ptr<MidiInputPort> port, std::shared_ptr<MidiInputQueue> queue) {
+    char threadName[32];
+    sprintf(threadName, "mi %s", deviceIdStr.c_str());
+    configureCurrentThread(MIDI_THREAD_INPUT, threadName);
+    ioThreadStarted();
+
+    MidiRawmidiReader reader;
+    openRawmidiReader(reader, deviceIdStr, handle, port, queue, false);
+
+    struct pollfd descriptors[MAX_POLL_DESCRIPTORS];
+    int descriptorCount = snd_rawmidi_poll_descriptors(port->handle, descriptors, MAX_POLL_DESCRIPTORS - 1);
+    descriptors[descriptorCount].fd = wakeupFd;
+    descriptors[descriptorCount].events = POLLIN;
+
+    while (!isStopped) {
+        if (poll(descriptors, descriptorCount + 1, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (isStopped || descriptors[descriptorCount].revents) {
+            break;
+        }
+        if (!readRawmidiInput(reader, descriptors[descriptorCount].fd)) {
+            break;
+        }
+    }
+    closeRawmidiReader(reader);
+}
+
+// input shards: each polls the descriptors of its devices and owns their parsers, nothing is shared between shards
+// the connection watcher hands a new device to the shard with the fewest
+struct MidiInputShard {
+    int fd; // eventfd, signaled when devices are handed over
+    std::mutex mutex; // added, shared with the connection watcher only
+    std::list<MidiRawmidiReader> added;
+    std::atomic<int> deviceCount;
+
+    ~MidiInputShard() {
+        // handed over while the shard was stopping
+        for (std::list<MidiRawmidiReader>::iterator it = added.begin(); it != added.end(); ++it) {
+            closeRawmidiReader(*it);
+        }
+        close(fd);
+    }
+};
+
+std::vector<std::shared_ptr<MidiInputShard>> inputShards; // set by InitializeMidiLinux, cleared by TerminateMidiLinux
+
+void midiInputShard(std::shared_ptr<MidiInputShard> shard, int index) {
+    char threadName[32];
+    sprintf(threadName, "mi shard %d", index);
+    configureCurrentThread(MIDI_THREAD_INPUT, threadName);
+    ioThreadStarted();
+
+    // the readers stay in place, their parsers point to their own sysex buffers
+    std::list<MidiRawmidiReader> readers;
+    std::vector<struct pollfd> descriptors;
+    descriptors.reserve(MAX_POLL_DESCRIPTORS);
+    bool isChanged = true;
+
+    while (!isStopped) {
+        if (isChanged) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                readers.splice(readers.end(), shard->added);
+            }
+            descriptors.clear();
+            for (std::list<MidiRawmidiReader>::iterator it = readers.begin(); it != readers.end(); ++it) {
+                it->firstDescriptor = descriptors.size();
+                it->descriptorCount = snd_rawmidi_poll_descriptors_count(it->port->handle);
+                descriptors.resize(it->firstDescriptor + it->descriptorCount);
+                snd_rawmidi_poll_descriptors(it->port->handle, &descriptors[it->firstDescriptor], it->descriptorCount);
+            }
+            struct pollfd descriptor;
+            descriptor.fd = shard->fd;
+            descriptor.events = POLLIN;
+            descriptors.push_back(descriptor);
+            descriptor.fd = wakeupFd;
+            descriptors.push_back(descriptor);
+            isChanged = false;
+        }
+
+        if (poll(descriptors.data(), descriptors.size(), -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (isStopped || descriptors.back().revents) {
+            break;
+        }
+        if (descriptors[descriptors.size() - 2].revents) {
+            uint64_t handovers;
+            read(shard->fd, &handovers, sizeof(handovers));
+            isChanged = true;
+        }
+
+        for (std::list<MidiRawmidiReader>::iterator it = readers.begin(); it != readers.end();) {
+            bool isReady = false;
+            for (int i = 0; i < it->descriptorCount; i++) {
+                isReady = isReady || descriptors[it->firstDescriptor + i].revents != 0;
+            }
+            // no sleeping on errors, the other devices would wait
+            if (isReady && !readRawmidiInput(*it, -1)) {
+                closeRawmidiReader(*it);
+                it = readers.erase(it);
+                shard->deviceCount--;
+                isChanged = true;
+                continue;
+            }
+            ++it;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        readers.splice(readers.end(), shard->added);
+    }
+    for (std::list<MidiRawmidiReader>::iterator it = readers.begin(); it != readers.end(); ++it) {
+        closeRawmidiReader(*it);
+    }
+}
+
+// caller holds lifecycleMutex
+void startInputShards() {
+    inputShardCount = inputShardSetting;
+    for (int i = 0; i < inputShardCount; i++) {
+        std::shared_ptr<MidiInputShard> shard = std::make_shared<MidiInputShard>();
+        shard->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        inputShards.push_back(shard);
+        startMidiThread(midiInputShard, shard, i);
+    }
+}
+
+// connection watcher: the shard with the fewest devices reads the new one
+void assignInputShard(const std::string& deviceId, int handle, std::shared_ptr<MidiInputPort> port, std::shared_ptr<MidiInputQueue> queue) {
+    MidiInputShard* shard = inputShards[0].get();
+    for (std::vector<std::shared_ptr<MidiInputShard>>::iterator it = inputShards.begin(); it != inputShards.end(); ++it) {
+        if ((*it)->deviceCount.load() < shard->deviceCount.load()) {
+            shard = it->get();
+        }
+    }
+    shard->deviceCount++;
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->added.emplace_back();
+        openRawmidiReader(shard->added.back(), deviceId, handle, port, queue, true);
+    }
+    uint64_t handover = 1;
+    write(shard->fd, &handover, sizeof(handover));
+}
+
+#ifdef MIDI_UMP_SUPPORTED
+// UMP endpoint input: packets are delivered as received, and translated for the MIDI 1.0 consumers
+void umpEventWatcher(std::string deviceIdStr, int handle, std::shared_ptr<MidiInputPort> port, std::shared_ptr<MidiInputQueue> queue) {
+    snd_ump_t* umpInput = port->ump;
+    ssize_t read;
+    unsigned int buffer[256];
+    int pendingWords = 0; // an incomplete packet, completed by the next read
+    unsigned char bytes[16];
+    const char* deviceId = deviceIdStr.c_str();
+
+    char threadName[32];
+    sprintf(threadName, "mi %s", deviceId);
+    configureCurrentThread(MIDI_THREAD_INPUT, threadName);
+    ioThreadStarted();
+
+    MidiParser parser;
+    initializeMidiParser(parser, handle, true, queue.get());
+    int errors = 0;
+    int brokerIndex = -1;
+
+    struct pollfd descriptors[MAX_POLL_DESCRIPTORS];
+    int descriptorCount = snd_ump_poll_descriptors(umpInput, descriptors, MAX_POLL_DESCRIPTORS - 1);
+    descriptors[descriptorCount].fd = wakeupFd;
+    descriptors[descriptorCount].events = POLLIN;
+
+    while (!isStopped) {
+        if (poll(descriptors, descriptorCount + 1, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (isStopped || descriptors[descriptorCount].revents) {
+            break;
+        }
+
+        {
+            MIDI_TRACE_SPAN("read");
+            read = snd_ump_read(umpInput, buffer + pendingWords, sizeof(buffer) - pendingWords * sizeof(unsigned int));
+            MIDI_TRACE_ARGUMENT(read);
+        }
+        if (read == -EAGAIN) {
+            continue;
+        }
+        if (read == -ENODEV || read == -EBADFD) {
+            // unplugged, the next scan detaches it
+            break;
+        }
+        if (read < 0) {
+            // packets were lost, drop the partial one
+            pendingWords = 0;
+            resetMidiParser(parser);
+            if (++errors > MIDI_INPUT_MAX_ERRORS || sleepUntilStopped(descriptors[descriptorCount].fd, 10)) {
+                break;
+            }
+            continue;
+        }
+        errors = 0;
+
+        int words = pendingWords + read / sizeof(unsigned int);
+        long long timestamp = currentTimestamp();
+        int offset = 0;
+        while (offset < words) {
+            int packetWords = UMP_PACKET_WORDS[UMP_MESSAGE_TYPE(buffer[offset])];
+            if (offset + packetWords > words) {
+                break;
+            }
+            deliverUmpPacket(handle, buffer + offset, packetWords);
+
+            int length = translateUmpToMidi1(buffer + offset, bytes);
+            if (length > 0) {
+                // captured and brokered as MIDI 1.0
+                captureMidiBytes(handle, timestamp, deviceId, false, bytes, length);
+                if (brokerRole == MIDI_BROKER_OWNER) {
+                    if (brokerIndex < 0) {
+                        brokerIndex = findBrokerDevice(deviceId);
+                    }
+                    if (brokerIndex >= 0) {
+                        publishBrokerInput(brokerIndex, bytes, length);
+                    }
+                }
+                parseMidi(parser, timestamp, bytes, length);
+            }
+            offset += packetWords;
+        }
+        pendingWords = words - offset;
+        memmove(buffer, buffer + offset, pendingWords * sizeof(unsigned int));
+    }
+
+    // the input thread owns its handle
+    snd_ump_close(umpInput);
+    port->closed = true;
+}
+#endif
+
+// client: parses the owner's input like the local readers would
+void brokerInputWatcher() {
+    configureCurrentThread(MIDI_THREAD_INPUT, "midi-broker-in");
+    ioThreadStarted();
+    MidiBrokerShared* shared = broker;
+
+    // one parser per table index, each with its own sysex buffer since the devices interleave
+    std::vector<MidiParser> parsers(MIDI_BROKER_DEVICES);
+    std::vector<std::vector<unsigned char>> systemExclusiveStreams(MIDI_BROKER_DEVICES);
+    for (int i = 0; i < MIDI_BROKER_DEVICES; i++) {
+        initializeMidiParser(parsers[i], 0, false, nullptr);
+        systemExclusiveStreams[i].reserve(IO_ARENA_SYSEX_RESERVE);
+        parsers[i].systemExclusiveStream = &systemExclusiveStreams[i];
+    }
+
+    // the queue of each table index, resolved again whenever the registry changes;
+    // the pin keeps the queues alive between lookups
+    std::shared_ptr<const MidiDeviceRegistry> resolvedRegistry;
+    std::vector<bool> isQueueResolved(MIDI_BROKER_DEVICES);
+
+    unsigned int epoch = shared->epoch.load();
+    unsigned long long cursor = shared->inputHead.load();
+    unsigned char data[sizeof(shared->input[0].data)];
+
+    while (!isStopped && broker == shared) {
+        if (shared->epoch.load() != epoch) {
+            // a new owner, with new rings and a new table
+            epoch = shared->epoch.load();
+            cursor = shared->inputHead.load();
+            for (int i = 0; i < MIDI_BROKER_DEVICES; i++) {
+                parsers[i].handle = 0;
+                isQueueResolved[i] = false;
+            }
+        }
+
+        if (cursor == shared->inputHead.load(std::memory_order_acquire)) {
+            unsigned int futex = shared->inputFutex.load();
+            shared->inputWaiters.fetch_add(1);
+            if (cursor == shared->inputHead.load(std::memory_order_acquire) && !isStopped) {
+                futexWait(&shared->inputFutex, futex, MIDI_BROKER_WAIT_MILLIS);
+            }
+            shared->inputWaiters.fetch_sub(1);
+            continue;
+        }
+
+        MidiBrokerInputSlot& slot = shared->input[cursor % MIDI_BROKER_INPUT_SLOTS];
+        unsigned long long sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence < 2 * cursor + 2) {
+            // still being written
+            std::this_thread::yield();
+            continue;
+        }
+        unsigned short index = slot.device;
+        unsigned short length = std::min<unsigned short>(slot.length, sizeof(data));
+        memcpy(data, slot.data, length);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence != 2 * cursor + 2 || slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            // overwritten, skip to the oldest slot still there
+            unsigned long long head = shared->inputHead.load();
+            unsigned long long oldest = head > MIDI_BROKER_INPUT_SLOTS ? head - MIDI_BROKER_INPUT_SLOTS + 1 : 0;
+            brokerLost += oldest > cursor ? oldest - cursor : 1;
+            cursor = std::max(oldest, cursor + 1);
+            // the lost slots could be of any device, one resync is counted for the loss
+            for (int i = 0; i < MIDI_BROKER_DEVICES; i++) {
+                clearMidiParser(parsers[i]);
+            }
+            countInputResync(nullptr);
+            continue;
+        }
+        cursor++;
+
+        if (index >= MIDI_BROKER_DEVICES) {
+            continue;
+        }
+        MidiParser& parser = parsers[index];
+        if (parser.handle == 0) {
+            MidiBrokerDevice devices[MIDI_BROKER_DEVICES];
+            int count = readBrokerDevices(devices);
+            if (index >= count) {
+                continue;
+            }
+            parser.handle = assignDeviceHandle(devices[index].id);
+            isQueueResolved[index] = false;
+        }
+
+        // the queue belongs to the registry entry, which the connection watcher makes from the same table
+        if (resolvedRegistry.get() != deviceRegistry.load(std::memory_order_acquire)) {
+            resolvedRegistry = pinDeviceRegistry();
+            std::fill(isQueueResolved.begin(), isQueueResolved.end(), false);
+        }
+        if (!isQueueResolved[index]) {
+            const MidiDeviceRegistry* registry = resolvedRegistry.get();
+            parser.queue = nullptr;
+            for (decltype(registry->devices)::const_iterator it = registry->devices.begin(); it != registry->devices.end(); ++it) {
+                if (it->second.handle == parser.handle) {
+                    parser.queue = it->second.queue.get();
+                    break;
+                }
+            }
+            isQueueResolved[index] = true;
+        }
+        parseMidi(parser, currentTimestamp(), data, length);
+    }
+}
+
+// client: mirrors the owner's table into the registry, like the card scan does for local devices
+void scanBrokerDevices(const MidiDeviceRegistry* current, MidiDeviceRegistry*& next, std::set<std::string>& currentInputs, std::set<std::string>& currentOutputs,
+    std::vector<std::string>& attachedInputs, std::vector<std::string>& attachedOutputs) {
+    if (!isBrokerOwnerAlive()) {
+        // everything detaches until an owner is back
+        return;
+    }
+
+    MidiBrokerDevice devices[MIDI_BROKER_DEVICES];
+    int count = readBrokerDevices(devices);
+    for (int i = 0; i < count; i++) {
+        const MidiBrokerDevice& brokerDevice = devices[i];
+        if (brokerDevice.directions & MIDI_DIRECTION_INPUT) {
+            currentInputs.insert(brokerDevice.id);
+            if (findMidiDevice(brokerDevice.id, MIDI_DIRECTION_INPUT) == nullptr) {
+                MidiDevice& midiDevice = editMidiDevice(current, next, brokerDevice.id, brokerDevice.name);
+                midiDevice.directions |= MIDI_DIRECTION_INPUT;
+                midiDevice.capabilities |= brokerDevice.capabilities | MIDI_CAPABILITY_BROKER;
+                midiDevice.queue = openInputQueue(brokerDevice.id, midiDevice.handle, false);
+                attachedInputs.push_back(brokerDevice.id);
+            }
+        }
+        if (brokerDevice.directions & MIDI_DIRECTION_OUTPUT) {
+            currentOutputs.insert(brokerDevice.id);
+            if (findMidiDevice(brokerDevice.id, MIDI_DIRECTION_OUTPUT) == nullptr) {
+                MidiDevice& midiDevice = editMidiDevice(current, next, brokerDevice.id, brokerDevice.name);
+                midiDevice.directions |= MIDI_DIRECTION_OUTPUT;
+                midiDevice.capabilities |= brokerDevice.capabilities | MIDI_CAPABILITY_BROKER;
+                midiDevice.output = std::make_shared<MidiOutputPort>();
+                midiDevice.output->brokerSlot = i + 1;
+                attachedOutputs.push_back(brokerDevice.id);
+            }
+        }
+    }
+}
+
+// card metadata cache
+// a card's ports are queried when it appears and again only when inotify reports a change of its /dev/snd nodes
+// without the watch every scan queries every card, as before
+struct MidiCardPort {
+    std::string deviceId;
+    std::string openName; // for snd_rawmidi_open, or snd_ump_open
+    int directions;
+    bool isUmp;
+};
+
+struct MidiCard {
+    bool opened; // the control device could be opened
+    std::string name;
+    std::vector<MidiCardPort> ports;
+};
+
+// a port opened by the scan before it takes the registry lock
+struct MidiOpenedPort {
+    const MidiCard* card;
+    const MidiCardPort* port;
+    int direction;
+    snd_rawmidi_t* rawmidi;
+#ifdef MIDI_UMP_SUPPORTED
+    snd_ump_t* ump;
+#endif
+    MidiRawmidiParams params;
+};
+
+void addMidiCardPort(MidiCard* result, const char* deviceId, const char* openName, int directions, bool isUmp) {
+    MidiCardPort port;
+    port.deviceId = deviceId;
+    port.openName = openName;
+    port.directions = directions;
+    port.isUmp = isUmp;
+    result->ports.push_back(port);
+}
+
+// reads the ports of one card, touches no shared state so that cards can be queried in parallel
+void queryMidiCard(int card, MidiCard* result) {
+    MIDI_TRACE_SPAN("card");
+    MIDI_TRACE_ARGUMENT(card);
+    result->opened = false;
+
+    char name[32];
+    sprintf(name, "hw:%d", card);
+    snd_ctl_t* ctl;
+    if (snd_ctl_open(&ctl, name, 0) < 0) {
+        return;
+    }
+    result->opened = true;
+
+    char* cardName = nullptr;
+    if (snd_card_get_name(card, &cardName) >= 0 && cardName != nullptr) {
+        result->name = cardName;
+    }
+    free(cardName);
 
-    // states
-    const int MIDI_STATE_WAIT = 0;
-    const int MIDI_STATE_SIGNAL_2BYTES_2 = 21;
-    const int MIDI_STATE_SIGNAL_3BYTES_2 = 31;
-    const int MIDI_STATE_SIGNAL_3BYTES_3 = 32;
-    const int MIDI_STATE_SIGNAL_SYSEX = 41;
+    char deviceId[32];
+    char openName[32];
+    snd_rawmidi_info_t* info;
+    snd_rawmidi_info_alloca(&info);
 
-    unsigned char midiEventKind;
-    unsigned char midiEventNote;
-    unsigned char midiEventVelocity;
-    int midiState = MIDI_STATE_WAIT;
-    std::vector<unsigned char> systemExclusiveStream;
-    char eventMessage[128];
-    const char* deviceId = deviceIdStr.c_str();
+    int device = -1;
+    while (snd_ctl_rawmidi_next_device(ctl, &device) >= 0 && device >= 0) {
+        snd_rawmidi_info_set_device(info, device);
 
-    while (!isStopped) {
-        read = snd_rawmidi_read(midiInput, buffer, sizeof(buffer));
-        if (read < 0) {
-            // failed, stop this device
-            snd_rawmidi_close(midiInput);
-            break;
+        // sub devices: inputs, then outputs
+        const snd_rawmidi_stream_t streams[] = {SND_RAWMIDI_STREAM_INPUT, SND_RAWMIDI_STREAM_OUTPUT};
+        for (int i = 0; i < 2; i++) {
+            snd_rawmidi_info_set_stream(info, streams[i]);
+            if (snd_ctl_rawmidi_info(ctl, info) < 0) {
+                // no such stream on this device
+                continue;
+            }
+            int subs = snd_rawmidi_info_get_subdevices_count(info);
+            for (int sub = 0; sub < subs; sub++) {
+                sprintf(openName, "hw:%d,%d,%d", card, device, sub);
+                sprintf(deviceId, "hw:%d-%d-%d", card, device, sub);
+                addMidiCardPort(result, deviceId, openName, i == 0 ? MIDI_DIRECTION_INPUT : MIDI_DIRECTION_OUTPUT, false);
+            }
         }
+    }
 
-        if (read > 0) {
-            // parse MIDI
-            for (int i = 0; i < read; i++) {
-                unsigned char midiEvent = buffer[i];
-
-                if (midiState == MIDI_STATE_WAIT) {
-                    switch (midiEvent & 0xf0) {
-                        case 0xf0: {
-                            switch (midiEvent) {
-                                case 0xf0:
-                                    systemExclusiveStream.clear();
-                                    systemExclusiveStream.push_back(midiEvent);
-                                    midiState = MIDI_STATE_SIGNAL_SYSEX;
-                                    break;
-
-                                case 0xf1:
-                                case 0xf3:
-                                    // 0xf1 MIDI Time Code Quarter Frame. : 2bytes
-                                    // 0xf3 Song Select. : 2bytes
-                                    midiEventKind = midiEvent;
-                                    midiState = MIDI_STATE_SIGNAL_2BYTES_2;
-                                    break;
-
-                                case 0xf2:
-                                    // 0xf2 Song Position Pointer. : 3bytes
-                                    midiEventKind = midiEvent;
-                                    midiState = MIDI_STATE_SIGNAL_3BYTES_2;
-                                    break;
-
-                                case 0xf6:
-                                    // 0xf6 Tune Request : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiTuneRequest", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xf8:
-                                    // 0xf8 Timing Clock : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiTimingClock", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xfa:
-                                    // 0xfa Start : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiStart", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xfb:
-                                    // 0xfb Continue : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiContinue", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xfc:
-                                    // 0xfc Stop : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiStop", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xfe:
-                                    // 0xfe Active Sensing : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiActiveSensing", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xff:
-                                    // 0xff Reset : 1byte
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiReset", deviceId);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-
-                                default:
-                                    break;
-                            }
-                        }
-                        break;
-                        case 0x80:
-                        case 0x90:
-                        case 0xa0:
-                        case 0xb0:
-                        case 0xe0:
-                            // 3bytes pattern
-                            midiEventKind = midiEvent;
-                            midiState = MIDI_STATE_SIGNAL_3BYTES_2;
-                            break;
-                        case 0xc0: // program change
-                        case 0xd0: // channel after-touch
-                            // 2bytes pattern
-                            midiEventKind = midiEvent;
-                            midiState = MIDI_STATE_SIGNAL_2BYTES_2;
-                            break;
-                        default:
-                            // 0x00 - 0x70: running status
-                            if ((midiEventKind & 0xf0) != 0xf0) {
-                                    // previous event kind is multi-bytes pattern
-                                    midiEventNote = midiEvent;
-                                    midiState = MIDI_STATE_SIGNAL_3BYTES_3;
-                            }
-                            break;
-                    }
-                } else if (midiState == MIDI_STATE_SIGNAL_2BYTES_2) {
-                    switch (midiEventKind & 0xf0) {
-                        // 2bytes pattern
-                        case 0xc0: // program change
-                            midiEventNote = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d", deviceId, midiEventKind & 0xf, midiEventNote);
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiProgramChange", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0xd0: // channel after-touch
-                            midiEventNote = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d", deviceId, midiEventKind & 0xf, midiEventNote);
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiChannelAftertouch", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0xf0: {
-                            switch (midiEventKind) {
-                                case 0xf1:
-                                    // 0xf1 MIDI Time Code Quarter Frame. : 2bytes
-                                    midiEventNote = midiEvent;
-                                    sprintf(eventMessage, "%s,0,%d", deviceId, midiEventNote);
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiTimeCodeQuarterFrame", eventMessage);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                case 0xf3:
-                                    // 0xf3 Song Select. : 2bytes
-                                    midiEventNote = midiEvent;
-                                    sprintf(eventMessage, "%s,0,%d", deviceId, midiEventNote);
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSongSelect", eventMessage);
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                                default:
-                                    // illegal state
-                                    midiState = MIDI_STATE_WAIT;
-                                    break;
-                            }
-                        }
-                            break;
-                        default:
-                            // illegal state
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                    }
-                } else if (midiState == MIDI_STATE_SIGNAL_3BYTES_2) {
-                    switch (midiEventKind & 0xf0) {
-                        case 0x80:
-                        case 0x90:
-                        case 0xa0:
-                        case 0xb0:
-                        case 0xe0:
-                        case 0xf0:
-                            // 3bytes pattern
-                            midiEventNote = midiEvent;
-                            midiState = MIDI_STATE_SIGNAL_3BYTES_3;
-                            break;
-                        default:
-                            // illegal state
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                    }
-                } else if (midiState == MIDI_STATE_SIGNAL_3BYTES_3) {
-                    switch (midiEventKind & 0xf0) {
-                        // 3bytes pattern
-                        case 0x80: // note off
-                            midiEventVelocity = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, midiEventKind & 0xf, midiEventNote, midiEventVelocity);
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiNoteOff", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0x90: // note on
-                            midiEventVelocity = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, midiEventKind & 0xf, midiEventNote, midiEventVelocity);
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiNoteOn", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0xa0: // control polyphonic key pressure
-                            midiEventVelocity = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, midiEventKind & 0xf, midiEventNote, midiEventVelocity);
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiPolyphonicAftertouch", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0xb0: // control change
-                            midiEventVelocity = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d,%d", deviceId, midiEventKind & 0xf, midiEventNote, midiEventVelocity);
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiControlChange", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0xe0: // pitch bend
-                            midiEventVelocity = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d,%d", deviceId, midiEventKind & 0xf, (midiEventNote & 0x7f) | ((midiEventVelocity & 0x7f) << 7));
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiPitchWheel", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        case 0xf0: // Song Position Pointer.
-                            midiEventVelocity = midiEvent;
-                            sprintf(eventMessage, "%s,0,%d", deviceId, (midiEventNote & 0x7f) | ((midiEventVelocity & 0x7f) << 7));
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSongPositionPointer", eventMessage);
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                        default:
-                            // illegal state
-                            midiState = MIDI_STATE_WAIT;
-                            break;
-                    }
-                } else if (midiState == MIDI_STATE_SIGNAL_SYSEX) {
-                    if (midiEvent == 0xf7) {
-                        // the end of message
-                        if (!systemExclusiveStream.empty()) {
-                            std::ostringstream oss;
-                            oss << deviceId;
-                            oss << ",0,";
-                            std::copy(systemExclusiveStream.begin(), systemExclusiveStream.end(), std::ostream_iterator<int>(oss, ","));
-                            oss << (int)midiEvent;
-
-                            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiSystemExclusive", oss.str().c_str());
-                        }
-                        systemExclusiveStream.clear();
+#ifdef MIDI_UMP_SUPPORTED
+    // UMP endpoints
+    device = -1;
+    while (snd_ctl_ump_next_device(ctl, &device) >= 0 && device >= 0) {
+        sprintf(openName, "hw:%d,%d", card, device);
+        sprintf(deviceId, "ump:%d-%d", card, device);
+        addMidiCardPort(result, deviceId, openName, MIDI_DIRECTION_INPUT | MIDI_DIRECTION_OUTPUT, true);
+    }
+#endif
+    snd_ctl_close(ctl);
+}
 
-                        midiState = MIDI_STATE_WAIT;
-                    } else {
-                        systemExclusiveStream.push_back(midiEvent);
-                    }
+// marks the cards whose control, rawmidi or UMP nodes changed
+// returns false when events were lost, then every card has to be queried again
+bool readMidiCardChanges(int fd, int& watch, std::set<int>& changedCards) {
+    alignas(struct inotify_event) char buffer[4096];
+    bool complete = true;
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length;) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                complete = false;
+            } else if (event->mask & IN_IGNORED) {
+                // /dev/snd went away with the last card
+                watch = -1;
+                complete = false;
+            } else if (event->len > 0) {
+                int card;
+                if (sscanf(event->name, "controlC%d", &card) == 1 || sscanf(event->name, "midiC%d", &card) == 1 ||
+                    sscanf(event->name, "umpC%d", &card) == 1) {
+                    changedCards.insert(card);
                 }
             }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return complete;
+}
+
+// brings the cache up to date with the present cards, the stale ones are queried in parallel
+void refreshMidiCards(std::map<int, MidiCard>& cards, std::set<int>& changedCards, bool isCacheValid) {
+    std::vector<int> present;
+    int card = -1;
+    while (snd_card_next(&card) >= 0 && card >= 0) {
+        present.push_back(card);
+    }
+
+    for (std::map<int, MidiCard>::iterator it = cards.begin(); it != cards.end();) {
+        if (std::find(present.begin(), present.end(), it->first) == present.end()) {
+            it = cards.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    std::vector<int> stale;
+    int newCards = 0;
+    for (std::vector<int>::iterator it = present.begin(); it != present.end(); ++it) {
+        bool isNew = cards.find(*it) == cards.end();
+        if (!isCacheValid || isNew || changedCards.find(*it) != changedCards.end()) {
+            stale.push_back(*it);
+            newCards += isNew;
+        }
+    }
+    changedCards.clear();
+
+    std::vector<MidiCard> results(stale.size());
+    if (newCards > 1) {
+        // a bulk refresh, like the first scan: every card has its own control device, the queries don't wait on each other
+        std::vector<std::thread> queries;
+        for (size_t i = 0; i < stale.size(); i++) {
+            queries.emplace_back(queryMidiCard, stale[i], &results[i]);
+        }
+        for (std::vector<std::thread>::iterator it = queries.begin(); it != queries.end(); ++it) {
+            it->join();
         }
+    } else {
+        // the rescans of known cards, every scan without inotify, aren't worth a thread per card
+        for (size_t i = 0; i < stale.size(); i++) {
+            queryMidiCard(stale[i], &results[i]);
+        }
+    }
 
-        std::this_thread::sleep_for(10ms);
+    for (size_t i = 0; i < stale.size(); i++) {
+        if (results[i].opened) {
+            cards[stale[i]] = std::move(results[i]);
+        } else {
+            // not accessible yet, tried again on the next scan
+            cards.erase(stale[i]);
+        }
     }
 }
 
@@ -450,52 +4300,120 @@ static int check_permission(snd_seq_port_info_t *pinfo, int perm) {
 }
 
 void midiConnectionWatcher() {
-    using namespace std::chrono_literals;
+    configureCurrentThread(MIDI_THREAD_CONNECTION, "midi-connect");
+    int stopFd = wakeupFd;
 
     char deviceId[32];
 
     // virtual midi
-    int client;
-    int port;
-
     snd_seq_client_info_t *cinfo;
     snd_seq_port_info_t *pinfo;
 
     snd_seq_client_info_alloca(&cinfo);
     snd_seq_port_info_alloca(&pinfo);
 
-    // rawmidi
-    int status;
-    int card;
+    // rawmidi and UMP cards
+    std::map<int, MidiCard> cards;
+    std::set<int> changedCards;
+    int cardsFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int cardsWatch = -1;
+    std::vector<MidiOpenedPort> openedPorts;
 
-    snd_ctl_t *ctl;
-    char name[32];
-    int device;
-    char sub_name[32];
+    // current connections to detect detached
+    std::set<std::string> currentInputs;
+    std::set<std::string> currentOutputs;
 
-    char* deviceName = NULL;
+    // sent after the new snapshot is published
+    std::vector<std::string> attachedInputs;
+    std::vector<std::string> attachedOutputs;
+    std::vector<std::shared_ptr<MidiOutputPort>> outputsToClose;
+    std::vector<std::pair<std::string, std::shared_ptr<MidiInputQueue>>> detachedInputs;
+    std::vector<std::string> detachedOutputs;
 
-    snd_rawmidi_info_t *info;
-    int subs;
-    int sub;
+    while (!isStopped) {
+        MIDI_TRACE_SPAN("scan");
+        currentInputs.clear();
+        currentOutputs.clear();
+        attachedInputs.clear();
+        attachedOutputs.clear();
+        outputsToClose.clear();
+        detachedInputs.clear();
+        detachedOutputs.clear();
+        openedPorts.clear();
+
+        bool isCacheValid = false;
+        if (cardsFd >= 0) {
+            bool wasWatched = cardsWatch >= 0;
+            bool complete = readMidiCardChanges(cardsFd, cardsWatch, changedCards);
+            if (cardsWatch < 0) {
+                // the cards are queried after the watch is in place, so no change is missed
+                cardsWatch = inotify_add_watch(cardsFd, "/dev/snd", IN_CREATE | IN_DELETE | IN_ATTRIB);
+            }
+            isCacheValid = wasWatched && complete;
+        }
 
-    snd_rawmidi_info_alloca(&info);
+        // rawmidi ports are opened before taking the registry lock, so a slow open doesn't block the other writers
+        // only this thread adds devices, the snapshot checks stay valid until the lock is taken
+        // opened by the broker owner when there is one
+        if (brokerRole != MIDI_BROKER_CLIENT) {
+            refreshMidiCards(cards, changedCards, isCacheValid);
+            for (decltype(cards)::const_iterator card = cards.begin(); card != cards.end(); ++card) {
+                for (std::vector<MidiCardPort>::const_iterator port = card->second.ports.begin(); port != card->second.ports.end(); ++port) {
+                    for (int direction = MIDI_DIRECTION_INPUT; direction <= MIDI_DIRECTION_OUTPUT; direction <<= 1) {
+                        if (!(port->directions & direction)) {
+                            continue;
+                        }
+                        (direction == MIDI_DIRECTION_INPUT ? currentInputs : currentOutputs).insert(port->deviceId);
+                        if (findMidiDevice(port->deviceId.c_str(), direction) != nullptr) {
+                            continue;
+                        }
 
-    // current connections to detect detached
-    std::set<std::string> currentConnections;
-    std::set<std::string> connectionsToRemove;
+                        MidiOpenedPort opened = {};
+                        opened.card = &card->second;
+                        opened.port = &*port;
+                        opened.direction = direction;
+                        bool isInput = direction == MIDI_DIRECTION_INPUT;
+                        if (port->isUmp) {
+#ifdef MIDI_UMP_SUPPORTED
+                            snd_ump_open(isInput ? &opened.ump : NULL, isInput ? NULL : &opened.ump, port->openName.c_str(), isInput ? SND_RAWMIDI_NONBLOCK : 0);
+                            if (opened.ump) {
+                                openedPorts.push_back(opened);
+                            }
+#endif
+                            continue;
+                        }
+                        // outputs without SND_RAWMIDI_SYNC, the parameters decide whether writes drain
+                        snd_rawmidi_open(isInput ? &opened.rawmidi : NULL, isInput ? NULL : &opened.rawmidi, port->openName.c_str(), isInput ? SND_RAWMIDI_NONBLOCK : 0);
+                        if (opened.rawmidi) {
+                            applyRawmidiParams(opened.rawmidi, configuredRawmidiParams(port->deviceId.c_str()), &opened.params);
+                            openedPorts.push_back(opened);
+                        }
+                    }
+                }
+            }
+        }
+
+        std::unique_lock<std::mutex> registryLock(deviceRegistryWriterMutex);
+        const MidiDeviceRegistry* current = deviceRegistry.load();
+        MidiDeviceRegistry* next = nullptr;
 
-    while (!isStopped) {
         // virtual midi
-        currentConnections.clear();
         snd_seq_client_info_set_client(cinfo, -1);
-        while (snd_seq_query_next_client(seq_handle, cinfo) >= 0) {
+        while (seq_handle != nullptr && snd_seq_query_next_client(seq_handle, cinfo) >= 0) {
             // loop with client
             if (snd_seq_client_info_get_type(cinfo) == SND_SEQ_KERNEL_CLIENT) {
                 // system client: ignore
                 continue;
             }
 
+            int sequencerUmpCapability = 0;
+#ifdef MIDI_UMP_SUPPORTED
+            if (snd_seq_client_info_get_midi_version(cinfo) != SND_SEQ_CLIENT_LEGACY_MIDI) {
+                // UMP client, the sequencer translates to and from our legacy events
+                sequencerUmpCapability = MIDI_CAPABILITY_UMP;
+            }
+#endif
+
             // reset query info
             snd_seq_port_info_set_client(pinfo, snd_seq_client_info_get_client(cinfo));
             snd_seq_port_info_set_port(pinfo, -1);
@@ -511,594 +4429,1470 @@ void midiConnectionWatcher() {
                     continue;
                 }
 
+                sprintf(deviceId, "seq:%d-%d", addr.client, addr.port);
                 if (check_permission(pinfo, LIST_INPUT)) {
                     // found a input port
-                    sprintf(deviceId, "seq:%d-%d", addr.client, addr.port);
-                    currentConnections.insert(deviceId);
-
-                    std::lock_guard<std::mutex> lock(virtualMidiInputMapMutex);
-                    if (virtualMidiInputMap.find(deviceId) == virtualMidiInputMap.end()) {
-                        const char* deviceName = snd_seq_client_info_get_name(cinfo);
-                        if (deviceNames.find(deviceId) == deviceNames.end()) {
-                            deviceNames.insert(std::make_pair(deviceId, deviceName));
-                        }
-                        virtualMidiInputMap.insert(std::make_pair(deviceId, addr));
-
-                        UnitySendMessage(GAME_OBJECT_NAME, "OnMidiInputDeviceAttached", deviceId);
+                    currentInputs.insert(deviceId);
+
+                    if (findMidiDevice(deviceId, MIDI_DIRECTION_INPUT) == nullptr) {
+                        MidiDevice& midiDevice = editMidiDevice(current, next, deviceId, snd_seq_client_info_get_name(cinfo));
+                        midiDevice.directions |= MIDI_DIRECTION_INPUT;
+                        midiDevice.capabilities |= MIDI_CAPABILITY_SEQUENCER | sequencerUmpCapability;
+                        midiDevice.address = addr;
+                        midiDevice.queue = openInputQueue(deviceId, midiDevice.handle, true);
+                        attachedInputs.push_back(deviceId);
                     }
                 }
 
                 if (check_permission(pinfo, LIST_OUTPUT)) {
                     // found a output port
-                    sprintf(deviceId, "seq:%d-%d", addr.client, addr.port);
-                    currentConnections.insert(deviceId);
-
-                    std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-                    if (virtualMidiOutputMap.find(deviceId) == virtualMidiOutputMap.end()) {
-                        const char* deviceName = snd_seq_client_info_get_name(cinfo);
-                        if (deviceNames.find(deviceId) == deviceNames.end()) {
-                            deviceNames.insert(std::make_pair(deviceId, deviceName));
-                        }
-                        virtualMidiOutputMap.insert(std::make_pair(deviceId, addr));
-
-                        UnitySendMessage(GAME_OBJECT_NAME, "OnMidiOutputDeviceAttached", deviceId);
+                    currentOutputs.insert(deviceId);
+
+                    if (findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT) == nullptr) {
+                        MidiDevice& midiDevice = editMidiDevice(current, next, deviceId, snd_seq_client_info_get_name(cinfo));
+                        midiDevice.directions |= MIDI_DIRECTION_OUTPUT;
+                        midiDevice.capabilities |= MIDI_CAPABILITY_SEQUENCER | sequencerUmpCapability;
+                        midiDevice.address = addr;
+                        attachedOutputs.push_back(deviceId);
                     }
                 }
             }
         }
 
-        connectionsToRemove.clear();
-        {
-            std::lock_guard<std::mutex> lock(virtualMidiInputMapMutex);
-
-            for (std::map<std::string, snd_seq_addr_t>::iterator it = virtualMidiInputMap.begin(); it != virtualMidiInputMap.end(); ++it) {
-                if (currentConnections.find(it->first) == currentConnections.end()) {
-                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiInputDeviceDetached", it->first.c_str());
-                    connectionsToRemove.insert(it->first);
+        // rawmidi and UMP, or the broker owner's devices
+        if (brokerRole == MIDI_BROKER_CLIENT) {
+            scanBrokerDevices(current, next, currentInputs, currentOutputs, attachedInputs, attachedOutputs);
+        }
+        for (std::vector<MidiOpenedPort>::iterator it = openedPorts.begin(); it != openedPorts.end(); ++it) {
+            const MidiCardPort* port = it->port;
+            MidiDevice& midiDevice = editMidiDevice(current, next, port->deviceId.c_str(), it->card->name.c_str());
+            midiDevice.directions |= it->direction;
+            midiDevice.capabilities |= port->isUmp ? MIDI_CAPABILITY_UMP : MIDI_CAPABILITY_RAWMIDI;
+
+            if (it->direction == MIDI_DIRECTION_INPUT) {
+                midiDevice.input = std::make_shared<MidiInputPort>();
+                midiDevice.input->handle = it->rawmidi;
+#ifdef MIDI_UMP_SUPPORTED
+                midiDevice.input->ump = it->ump;
+#endif
+                midiDevice.input->params = it->params;
+                midiDevice.input->closed = false;
+                midiDevice.queue = openInputQueue(port->deviceId.c_str(), midiDevice.handle, false);
+
+                // input watcher thread, or a shard
+                if (port->isUmp) {
+                    startMidiThread(umpEventWatcher, port->deviceId, midiDevice.handle, midiDevice.input, midiDevice.queue);
+                } else if (inputShardCount > 0) {
+                    assignInputShard(port->deviceId, midiDevice.handle, midiDevice.input, midiDevice.queue);
+                } else {
+                    startMidiThread(midiEventWatcher, port->deviceId, midiDevice.handle, midiDevice.input, midiDevice.queue);
                 }
+
+                attachedInputs.push_back(port->deviceId);
+            } else {
+                midiDevice.output = std::make_shared<MidiOutputPort>();
+                midiDevice.output->handle = it->rawmidi;
+#ifdef MIDI_UMP_SUPPORTED
+                midiDevice.output->ump = it->ump;
+#endif
+                midiDevice.output->params = it->params;
+
+                attachedOutputs.push_back(port->deviceId);
             }
-            for (std::set<std::string>::iterator it = connectionsToRemove.begin(); it != connectionsToRemove.end(); ++it) {
-                virtualMidiInputMap.erase(*it);
+        }
+
+        // in-process loopback
+        if (isLoopbackEnabled) {
+            currentInputs.insert(MIDI_LOOPBACK_ID);
+            currentOutputs.insert(MIDI_LOOPBACK_ID);
+
+            if (findMidiDevice(MIDI_LOOPBACK_ID, MIDI_DIRECTION_INPUT | MIDI_DIRECTION_OUTPUT) == nullptr) {
+                MidiDevice& midiDevice = editMidiDevice(current, next, MIDI_LOOPBACK_ID, "Loopback");
+                midiDevice.directions |= MIDI_DIRECTION_INPUT | MIDI_DIRECTION_OUTPUT;
+                midiDevice.capabilities |= MIDI_CAPABILITY_LOOPBACK;
+                midiDevice.queue = openInputQueue(MIDI_LOOPBACK_ID, midiDevice.handle, false);
+                midiDevice.output = std::make_shared<MidiOutputPort>();
+                midiDevice.output->loopback = openLoopback(midiDevice.handle, midiDevice.queue);
+
+                attachedInputs.push_back(MIDI_LOOPBACK_ID);
+                attachedOutputs.push_back(MIDI_LOOPBACK_ID);
             }
         }
-        connectionsToRemove.clear();
-        {
-            std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-            for (std::map<std::string, snd_seq_addr_t>::iterator it = virtualMidiOutputMap.begin(); it != virtualMidiOutputMap.end(); ++it) {
-                if (currentConnections.find(it->first) == currentConnections.end()) {
-                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiOutputDeviceDetached", it->first.c_str());
-                    connectionsToRemove.insert(it->first);
+
+        // detached, or inputs whose thread stopped on a read error
+        for (decltype(current->devices)::const_iterator it = current->devices.begin(); it != current->devices.end(); ++it) {
+            const MidiDevice& midiDevice = it->second;
+            if ((midiDevice.directions & MIDI_DIRECTION_INPUT) &&
+                (currentInputs.find(it->first) == currentInputs.end() || (midiDevice.input && midiDevice.input->closed))) {
+                MidiDevice& edited = editMidiDevice(current, next, it->first.c_str(), nullptr);
+                edited.directions &= ~MIDI_DIRECTION_INPUT;
+                edited.input.reset();
+                if (edited.queue) {
+                    closeInputQueue(edited.queue.get());
                 }
+                detachedInputs.push_back(std::make_pair(it->first, edited.queue));
+                edited.queue.reset();
             }
-            for (std::set<std::string>::iterator it = connectionsToRemove.begin(); it != connectionsToRemove.end(); ++it) {
-                virtualMidiOutputMap.erase(*it);
+            if ((midiDevice.directions & MIDI_DIRECTION_OUTPUT) && currentOutputs.find(it->first) == currentOutputs.end()) {
+                detachedOutputs.push_back(it->first);
+                MidiDevice& edited = editMidiDevice(current, next, it->first.c_str(), nullptr);
+                edited.directions &= ~MIDI_DIRECTION_OUTPUT;
+                if (edited.output) {
+                    outputsToClose.push_back(edited.output);
+                    edited.output.reset();
+                }
             }
         }
 
-        // rawmidi
-        currentConnections.clear();
-        card = -1;
-        if ((status = snd_card_next(&card)) >= 0 && (card >= 0)) {
-            while (card >= 0) {
-                sprintf(name, "hw:%d", card);
-                if ((status = snd_ctl_open(&ctl, name, 0)) < 0) {
-                    continue;
+        if (next != nullptr) {
+            for (decltype(next->devices)::iterator it = next->devices.begin(); it != next->devices.end();) {
+                if (it->second.directions == 0) {
+                    it = next->devices.erase(it);
+                } else {
+                    ++it;
                 }
-                snd_card_get_name(card, &deviceName);
-                device = -1;
-                do {
-                    status = snd_ctl_rawmidi_next_device(ctl, &device);
-                    if (status < 0) {
-                        break;
-                    }
-                    if (device >= 0) {
-                        snd_rawmidi_info_set_device(info, device);
-
-                        // sub devices: input
-                        snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_INPUT);
-                        snd_ctl_rawmidi_info(ctl, info);
-                        subs = snd_rawmidi_info_get_subdevices_count(info);
-                        for (sub = 0; sub < subs; sub++) {
-                            sprintf(sub_name, "hw:%d,%d,%d", card, device, sub);
-                            sprintf(deviceId, "hw:%d-%d-%d", card, device, sub);
-                            currentConnections.insert(deviceId);
-
-                            std::lock_guard<std::mutex> lock(midiInputMapMutex);
-                            if (midiInputMap.find(deviceId) == midiInputMap.end()) {
-                                snd_rawmidi_t* midiInput = NULL;
-                                snd_rawmidi_open(&midiInput, NULL, sub_name, SND_RAWMIDI_SYNC);
-                                if (midiInput) {
-                                    if (deviceNames.find(deviceId) == deviceNames.end()) {
-                                        deviceNames.insert(std::make_pair(deviceId, deviceName));
-                                    }
-                                    midiInputMap.insert(std::make_pair(deviceId, midiInput));
-
-                                    // input watcher thread
-                                    std::string deviceIdStr = deviceId;
-                                    std::thread midiInputThread(midiEventWatcher, deviceIdStr, midiInput);
-                                    midiInputThread.detach();
-
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiInputDeviceAttached", deviceId);
-                                }
-                            }
-                        }
-
-                        // sub devices: output
-                        snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_OUTPUT);
-                        snd_ctl_rawmidi_info(ctl, info);
-                        subs = snd_rawmidi_info_get_subdevices_count(info);
-                        for (sub = 0; sub < subs; sub++) {
-                            sprintf(sub_name, "hw:%d,%d,%d", card, device, sub);
-                            sprintf(deviceId, "hw:%d-%d-%d", card, device, sub);
-                            currentConnections.insert(deviceId);
-
-                            std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-                            if (midiOutputMap.find(deviceId) == midiOutputMap.end()) {
-                                snd_rawmidi_t* midiOutput = NULL;
-                                snd_rawmidi_open(NULL, &midiOutput, sub_name, SND_RAWMIDI_SYNC);
-                                if (midiOutput) {
-                                    if (deviceNames.find(deviceId) == deviceNames.end()) {
-                                        deviceNames.insert(std::make_pair(deviceId, deviceName));
-                                    }
-                                    midiOutputMap.insert(std::make_pair(deviceId, midiOutput));
-
-                                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiOutputDeviceAttached", deviceId);
-                                }
-                            }
-                        }
-                    }
-                } while (device >= 0);
-                snd_ctl_close(ctl);
+            }
+            publishDeviceRegistry(next);
+            if (brokerRole == MIDI_BROKER_OWNER) {
+                publishBrokerDevices(next);
+            }
+        }
+        registryLock.unlock();
+        collectRetired();
 
-                if ((status = snd_card_next(&card)) < 0) {
-                    break;
-                }
+        for (std::vector<std::shared_ptr<MidiOutputPort>>::iterator it = outputsToClose.begin(); it != outputsToClose.end(); ++it) {
+            closeMidiOutputPort(it->get());
+        }
+        for (size_t i = 0; i < detachedInputs.size(); i++) {
+            // after the events the device sent before it went away
+            if (detachedInputs[i].second) {
+                waitInputQueueDelivered(detachedInputs[i].second.get());
             }
+            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiInputDeviceDetached", detachedInputs[i].first.c_str());
+        }
+        for (std::vector<std::string>::iterator it = detachedOutputs.begin(); it != detachedOutputs.end(); ++it) {
+            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiOutputDeviceDetached", it->c_str());
+        }
+        for (std::vector<std::string>::iterator it = attachedInputs.begin(); it != attachedInputs.end(); ++it) {
+            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiInputDeviceAttached", it->c_str());
+        }
+        for (std::vector<std::string>::iterator it = attachedOutputs.begin(); it != attachedOutputs.end(); ++it) {
+            UnitySendMessage(GAME_OBJECT_NAME, "OnMidiOutputDeviceAttached", it->c_str());
         }
 
-        connectionsToRemove.clear();
-        {
-            std::lock_guard<std::mutex> lock(midiInputMapMutex);
-            for (std::map<std::string, snd_rawmidi_t*>::iterator it = midiInputMap.begin(); it != midiInputMap.end(); ++it) {
-                if (currentConnections.find(it->first) == currentConnections.end()) {
-                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiInputDeviceDetached", it->first.c_str());
-                    connectionsToRemove.insert(it->first);
-                }
+        MIDI_TRACE_END();
+        // a change under /dev/snd is scanned right away
+        struct pollfd descriptors[2];
+        descriptors[0].fd = stopFd;
+        descriptors[0].events = POLLIN;
+        descriptors[0].revents = 0;
+        descriptors[1].fd = cardsFd;
+        descriptors[1].events = POLLIN;
+        descriptors[1].revents = 0;
+        if (poll(descriptors, cardsFd >= 0 ? 2 : 1, 100) > 0 && (descriptors[0].revents & POLLIN)) {
+            break;
+        }
+    }
+
+    if (cardsFd >= 0) {
+        close(cardsFd);
+    }
+
+    // terminated, cleanup
+    // the input handles are closed by their input threads
+    std::lock_guard<std::mutex> registryLock(deviceRegistryWriterMutex);
+    const MidiDeviceRegistry* current = deviceRegistry.load();
+    for (decltype(current->devices)::const_iterator it = current->devices.begin(); it != current->devices.end(); ++it) {
+        if (it->second.output) {
+            closeMidiOutputPort(it->second.output.get());
+        }
+        if (it->second.queue) {
+            closeInputQueue(it->second.queue.get());
+        }
+    }
+    publishDeviceRegistry(new MidiDeviceRegistry());
+}
+
+void SetSendMessageCallback(OnSendMessageDelegate callback) {
+   onSendMessage = callback;
+}
+
+// also receives MIDI 1.0 input, translated to MIDI 2.0 channel voice packets
+void SetUmpPacketCallback(OnUmpPacketDelegate callback) {
+    onUmpPacket = callback;
+}
+
+void InitializeMidiLinux() {
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    if (isInitialized) {
+        return;
+    }
+
+    if (seq_handle == nullptr) {
+        snd_seq_open(&seq_handle, "default", SND_SEQ_OPEN_DUPLEX, 0);
+        snd_seq_set_client_name(seq_handle, "Midi Handler");
+        selfClientId = snd_seq_client_id(seq_handle);
+        selfPortNumber = snd_seq_create_simple_port(seq_handle, "inout",
+            SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ|SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+            SND_SEQ_PORT_TYPE_APPLICATION);
+    }
+
+    wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    dispatchFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (brokerMode != MIDI_BROKER_OFF) {
+        openBroker(brokerMode);
+    }
+
+    isStopped = false;
+    startInputShards();
+    startMidiThread(midiDispatchWatcher);
+    startMidiThread(midiConnectionWatcher);
+    if (brokerRole == MIDI_BROKER_OWNER) {
+        startMidiThread(brokerOutputWatcher);
+    } else if (brokerRole == MIDI_BROKER_CLIENT) {
+        startMidiThread(brokerInputWatcher);
+    }
+
+    // input watcher thread
+    if (seq_handle != nullptr) {
+        startMidiThread(virtualMidiEventWatcher);
+    }
+    {
+        std::lock_guard<std::mutex> subscribersLock(subscribersWriterMutex);
+        const MidiSubscriberList* subscribers = subscriberList.load();
+        for (std::vector<MidiSubscriber*>::const_iterator it = subscribers->subscribers.begin(); it != subscribers->subscribers.end(); ++it) {
+            if ((*it)->mode == MIDI_SUBSCRIPTION_CALLBACK) {
+                startSubscriberWorker(*it);
             }
-            for (std::set<std::string>::iterator it = connectionsToRemove.begin(); it != connectionsToRemove.end(); ++it) {
-                midiInputMap.erase(*it);
+        }
+        areSubscriberWorkersStarted = true;
+    }
+    isInitialized = true;
+
+    std::lock_guard<std::mutex> groupsLock(outputGroupsMutex);
+    for (decltype(outputGroups)::iterator it = outputGroups.begin(); it != outputGroups.end(); ++it) {
+        std::lock_guard<std::mutex> groupLock(it->second->mutex);
+        openGroupWriters(it->second.get());
+    }
+}
+
+void TerminateMidiLinux() {
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    if (!isInitialized) {
+        return;
+    }
+
+    isStopped = true;
+    uint64_t wakeup = 1;
+    write(wakeupFd, &wakeup, sizeof(wakeup));
+    {
+        // the workers are plugin threads, joined below with the others
+        std::lock_guard<std::mutex> subscribersLock(subscribersWriterMutex);
+        areSubscriberWorkersStarted = false;
+    }
+
+    bool allStopped;
+    {
+        std::unique_lock<std::mutex> threadsLock(midiThreadsMutex);
+        allStopped = midiThreadsCondition.wait_for(threadsLock, MIDI_THREAD_JOIN_TIMEOUT, [] { return runningThreads == 0; });
+        for (std::list<MidiThread>::iterator it = midiThreads.begin(); it != midiThreads.end(); ++it) {
+            if (allStopped) {
+                it->thread.join();
+            } else {
+                // stuck in a callback: don't hang the caller, the thread exits on its own later
+                it->thread.detach();
             }
         }
-        connectionsToRemove.clear();
-        {
-            std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-            for (std::map<std::string, snd_rawmidi_t*>::iterator it = midiOutputMap.begin(); it != midiOutputMap.end(); ++it) {
-                if (currentConnections.find(it->first) == currentConnections.end()) {
-                    UnitySendMessage(GAME_OBJECT_NAME, "OnMidiOutputDeviceDetached", it->first.c_str());
-                    connectionsToRemove.insert(it->first);
-                }
+        midiThreads.clear();
+    }
+
+    {
+        // the cached members keep the last snapshot of the session, and the writer threads are gone:
+        // the next session starts new ones, a stuck one keeps its own reference
+        std::lock_guard<std::mutex> groupsLock(outputGroupsMutex);
+        for (decltype(outputGroups)::iterator it = outputGroups.begin(); it != outputGroups.end(); ++it) {
+            std::lock_guard<std::mutex> groupLock(it->second->mutex);
+            it->second->resolved.reset();
+            it->second->writers.clear();
+        }
+        std::lock_guard<std::mutex> writersLock(outputWritersMutex);
+        outputWriters.clear();
+        outputWriterCount = 0;
+    }
+
+    if (allStopped) {
+        // twice: the first call may only flip the parity, the second frees what the plugin threads left
+        collectRetired();
+        collectRetired();
+
+        std::lock_guard<std::mutex> queuesLock(inputQueuesMutex);
+        inputQueues.clear();
+        close(dispatchFd);
+
+        closeBroker(true);
+        for (std::vector<MidiBrokerShared*>::iterator it = retiredBrokers.begin(); it != retiredBrokers.end(); ++it) {
+            munmap(*it, sizeof(MidiBrokerShared));
+        }
+        retiredBrokers.clear();
+
+        if (seq_handle != nullptr) {
+            snd_seq_close(seq_handle);
+            seq_handle = nullptr;
+        }
+        if (sequencerEncoder != nullptr) {
+            snd_midi_event_free(sequencerEncoder);
+            sequencerEncoder = nullptr;
+        }
+        close(wakeupFd);
+    }
+    if (!allStopped) {
+        // the next session takes the owner lock again instead of becoming a client of the stuck one
+        closeBroker(false);
+    }
+    // a stuck shard keeps its own reference
+    inputShards.clear();
+    // a stuck thread still polls the old descriptor, so it's left open in that case
+    wakeupFd = -1;
+    dispatchFd = -1;
+    isInitialized = false;
+}
+
+// the managed marshaller frees the returned string, so it stays a copy
+const char* GetDeviceNameLinux(const char* deviceId) {
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_INPUT | MIDI_DIRECTION_OUTPUT);
+    if (device != nullptr) {
+        return strdup(device->name.c_str());
+    }
+
+    return NULL;
+}
+
+// 0 if the device was never attached
+int GetDeviceHandleLinux(const char* deviceId) {
+    {
+        MidiReadSection section;
+        const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_INPUT | MIDI_DIRECTION_OUTPUT);
+        if (device != nullptr) {
+            return device->handle;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(deviceHandlesMutex);
+    decltype(deviceHandles)::iterator it = deviceHandles.find(deviceId);
+    if (it != deviceHandles.end()) {
+        return it->second;
+    }
+    return 0;
+}
+
+// writes every attached device into buffer, packed with native byte order:
+//   int count
+//   then per device:
+//     int handle, int directions, int capabilities
+//     short idLength, short nameLength (both including the terminating NUL)
+//     char id[idLength], char name[nameLength]
+// returns the required size in bytes; nothing is written if size is smaller
+int GetMidiDeviceList(unsigned char* buffer, int size) {
+    MidiReadSection section;
+    const MidiDeviceRegistry* registry = deviceRegistry.load(std::memory_order_acquire);
+
+    int required = sizeof(int);
+    for (decltype(registry->devices)::const_iterator it = registry->devices.begin(); it != registry->devices.end(); ++it) {
+        required += 3 * sizeof(int) + 2 * sizeof(short) + it->second.id.size() + 1 + it->second.name.size() + 1;
+    }
+    if (buffer == nullptr || size < required) {
+        return required;
+    }
+
+    unsigned char* out = buffer;
+    int count = registry->devices.size();
+    memcpy(out, &count, sizeof(int));
+    out += sizeof(int);
+    for (decltype(registry->devices)::const_iterator it = registry->devices.begin(); it != registry->devices.end(); ++it) {
+        const MidiDevice& device = it->second;
+        int fields[3] = {device.handle, device.directions, device.capabilities};
+        short lengths[2] = {(short)(device.id.size() + 1), (short)(device.name.size() + 1)};
+        memcpy(out, fields, sizeof(fields));
+        out += sizeof(fields);
+        memcpy(out, lengths, sizeof(lengths));
+        out += sizeof(lengths);
+        memcpy(out, device.id.c_str(), lengths[0]);
+        out += lengths[0];
+        memcpy(out, device.name.c_str(), lengths[1]);
+        out += lengths[1];
+    }
+    return required;
+}
+
+void SetMidiFrameBufferEnabled(bool enabled) {
+    isMidiFrameEnabled = enabled;
+}
+
+// call once per frame from a single thread, the returned pointers stay valid until the next call
+void SwapMidiFrame(MidiFramePointers* pointers, int* count) {
+    int index = midiFrameWriteIndex.load();
+    midiFrameBuffers[1 - index].count.store(0);
+    midiFrameWriteIndex.store(1 - index);
+
+    // wait for writers still appending to the previous side
+    MidiFrameBuffer& frame = midiFrameBuffers[index];
+    while (frame.writers.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+
+    int frameCount = frame.count.load();
+    if (frameCount > MIDI_FRAME_CAPACITY) {
+        midiFrameDropped += frameCount - MIDI_FRAME_CAPACITY;
+        frameCount = MIDI_FRAME_CAPACITY;
+    }
+
+    pointers->timestamps = frame.timestamps;
+    pointers->handles = frame.handles;
+    pointers->status = frame.status;
+    pointers->data1 = frame.data1;
+    pointers->data2 = frame.data2;
+    *count = frameCount;
+}
+
+void GetMidiMetrics(MidiMetrics* metrics) {
+    metrics->frameDropped = midiFrameDropped.load();
+#ifdef MIDI_DEBUG_ALLOCATIONS
+    metrics->ioAllocations = ioAllocations.load();
+#else
+    metrics->ioAllocations = -1;
+#endif
+    metrics->schedulingFallbacks = schedulingFallbacks.load();
+    metrics->inputDropped = inputDropped.load();
+    metrics->inputResyncs = inputResyncs.load();
+    metrics->captureDropped = captureDropped.load();
+    metrics->brokerLost = brokerLost.load();
+    metrics->outputDropped = outputDropped.load();
+    metrics->brokerSkipped = brokerSkipped.load();
+    metrics->brokerDropped = brokerDropped.load();
+    metrics->mpeOverflows = mpeOverflows.load();
+}
+
+// policy: SCHED_OTHER, SCHED_FIFO or SCHED_RR
+// falls back to the default policy at thread start when the process lacks CAP_SYS_NICE and RLIMIT_RTPRIO
+bool SetMidiThreadScheduling(int kind, int policy, int priority) {
+    if (kind < 0 || kind >= MIDI_THREAD_KIND_COUNT) {
+        return false;
+    }
+    if (policy != SCHED_OTHER && policy != SCHED_FIFO && policy != SCHED_RR) {
+        return false;
+    }
+    if (policy != SCHED_OTHER && (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy))) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(threadConfigsMutex);
+    threadConfigs[kind].policy = policy;
+    threadConfigs[kind].priority = priority;
+    return true;
+}
+
+// pins the threads of the kind to the given cores, count 0 clears the affinity
+bool SetMidiThreadAffinity(int kind, const int* cpus, int count) {
+    if (kind < 0 || kind >= MIDI_THREAD_KIND_COUNT) {
+        return false;
+    }
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (int i = 0; i < count; i++) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+            return false;
+        }
+        CPU_SET(cpus[i], &cpuSet);
+    }
+
+    std::lock_guard<std::mutex> lock(threadConfigsMutex);
+    threadConfigs[kind].hasAffinity = count > 0;
+    threadConfigs[kind].cpus = cpuSet;
+    return true;
+}
+
+// locks current and future pages, which also prefaults the frame buffers and the thread arenas
+bool SetMidiMemoryLocked(bool locked) {
+    if (locked) {
+        return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+    }
+    return munlockall() == 0;
+}
+
+void SetMidiTraceEnabled(bool enabled) {
+#ifndef MIDI_TRACE_DISABLED
+    if (enabled && traceBuffers.load() == nullptr) {
+        std::lock_guard<std::mutex> lock(traceBuffersMutex);
+        if (traceBuffers.load() == nullptr) {
+            traceBuffers.store(new MidiTraceBuffer[MIDI_TRACE_BUFFERS](), std::memory_order_release);
+        }
+    }
+    traceEnabled = enabled;
+#else
+    (void)enabled;
+#endif
+}
+
+bool DumpMidiTrace(const char* path) {
+#ifndef MIDI_TRACE_DISABLED
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    int pid = getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    std::lock_guard<std::mutex> lock(traceBuffersMutex);
+    MidiTraceBuffer* buffers = traceBuffers.load();
+    for (int i = 0; buffers != nullptr && i < MIDI_TRACE_BUFFERS; i++) {
+        MidiTraceBuffer* buffer = &buffers[i];
+        if (buffer->state == MIDI_TRACE_UNUSED) {
+            continue;
+        }
+        fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", pid, buffer->tid, buffer->threadName);
+        first = false;
+
+        unsigned long long head = buffer->head.load(std::memory_order_acquire);
+        unsigned long long position = std::max(buffer->start.load(), head > MIDI_TRACE_EVENTS ? head - MIDI_TRACE_EVENTS : 0);
+        for (; position < head; position++) {
+            MidiTraceEvent& event = buffer->events[position % MIDI_TRACE_EVENTS];
+            unsigned long long sequence = event.sequence.load(std::memory_order_acquire);
+            const char* name = event.name;
+            long long start = event.start;
+            long long duration = event.duration;
+            long long argument = event.argument;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence != position + 1 || event.sequence.load(std::memory_order_relaxed) != sequence) {
+                // rewritten by the thread meanwhile
+                continue;
             }
-            for (std::set<std::string>::iterator it = connectionsToRemove.begin(); it != connectionsToRemove.end(); ++it) {
-                midiOutputMap.erase(*it);
+            // Chrome trace timestamps are microseconds
+            fprintf(file, ",\n{\"ph\":\"X\",\"cat\":\"midi\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld",
+                name, pid, buffer->tid, start / 1000, start % 1000, duration / 1000, duration % 1000);
+            if (argument >= 0) {
+                fprintf(file, ",\"args\":{\"bytes\":%lld}", argument);
             }
+            fprintf(file, "}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+void ClearMidiTrace() {
+#ifndef MIDI_TRACE_DISABLED
+    std::lock_guard<std::mutex> lock(traceBuffersMutex);
+    MidiTraceBuffer* buffers = traceBuffers.load();
+    for (int i = 0; buffers != nullptr && i < MIDI_TRACE_BUFFERS; i++) {
+        MidiTraceBuffer* buffer = &buffers[i];
+        buffer->start = buffer->head.load();
+        int state = MIDI_TRACE_FINISHED;
+        buffer->state.compare_exchange_strong(state, MIDI_TRACE_UNUSED);
+    }
+#endif
+}
+
+bool SetMidiRawmidiProfile(const char* deviceId, int profile) {
+    if (profile < MIDI_RAWMIDI_DEFAULT || profile > MIDI_RAWMIDI_BULK) {
+        return false;
+    }
+    return SetMidiRawmidiParams(deviceId, &rawmidiProfiles[profile]);
+}
+
+bool SetMidiRawmidiParams(const char* deviceId, const MidiRawmidiParams* params) {
+    if (params->bufferSize < 0 || params->availMin < 0) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(rawmidiParamsConfigsMutex);
+        if (deviceId == nullptr) {
+            defaultRawmidiParams = *params;
+            return true;
+        }
+        rawmidiParamsConfigs[deviceId] = *params;
+    }
+
+    bool applied = true;
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_INPUT);
+    if (device != nullptr && device->input) {
+        std::lock_guard<std::mutex> lock(device->input->mutex);
+        if (device->input->handle != nullptr) {
+            applied = applyRawmidiParams(device->input->handle, *params, &device->input->params) && applied;
         }
+    }
+    device = findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT);
+    if (device != nullptr && device->output) {
+        std::lock_guard<std::mutex> lock(device->output->mutex);
+        if (device->output->handle != nullptr) {
+            applied = applyRawmidiParams(device->output->handle, *params, &device->output->params) && applied;
+        }
+    }
+    return applied;
+}
 
-        std::this_thread::sleep_for(100ms);
+bool GetMidiRawmidiParams(const char* deviceId, int direction, MidiRawmidiParams* params) {
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, direction);
+    if (device == nullptr) {
+        return false;
+    }
+    if (direction == MIDI_DIRECTION_INPUT && device->input) {
+        std::lock_guard<std::mutex> lock(device->input->mutex);
+        if (device->input->handle != nullptr) {
+            *params = device->input->params;
+            return true;
+        }
+    }
+    if (direction == MIDI_DIRECTION_OUTPUT && device->output) {
+        std::lock_guard<std::mutex> lock(device->output->mutex);
+        if (device->output->handle != nullptr) {
+            *params = device->output->params;
+            return true;
+        }
     }
+    return false;
+}
 
-    // terminated, cleanup
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiInputMapMutex);
-        virtualMidiInputMap.clear();
+bool SetMidiInputShards(int count) {
+    if (count < 0 || count > CPU_SETSIZE) {
+        return false;
     }
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        virtualMidiOutputMap.clear();
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    inputShardSetting = count;
+    return true;
+}
+
+// applies to the device right away when it's attached, and whenever it attaches again
+bool SetMidiInputQueue(const char* deviceId, int capacity, int policy) {
+    if (capacity < 1 || capacity > MIDI_QUEUE_MAX_CAPACITY || policy < MIDI_QUEUE_BLOCK || policy > MIDI_QUEUE_COALESCE) {
+        return false;
     }
+
+    MidiInputQueueConfig config = {capacity, policy};
     {
-        std::lock_guard<std::mutex> lock(midiInputMapMutex);
-        midiInputMap.clear();
+        std::lock_guard<std::mutex> lock(inputQueueConfigsMutex);
+        if (deviceId == nullptr) {
+            defaultInputQueueConfig = config;
+            return true;
+        }
+        inputQueueConfigs[deviceId] = config;
     }
-    {
-        std::lock_guard<std::mutex> lock(midiInputMapMutex);
-        midiOutputMap.clear();
+
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_INPUT);
+    if (device != nullptr && device->queue) {
+        MidiInputQueue* queue = device->queue.get();
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            resizeInputQueue(queue, capacity);
+            queue->policy = policy;
+        }
+        queue->notFull.notify_all();
     }
-    {
-        std::lock_guard<std::mutex> lock(deviceNamesMutex);
-        deviceNames.clear();
+    return true;
+}
+
+bool GetMidiInputQueueStats(const char* deviceId, MidiInputQueueStats* stats) {
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_INPUT);
+    if (device == nullptr || !device->queue) {
+        return false;
     }
+
+    MidiInputQueue* queue = device->queue.get();
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    stats->capacity = queue->events.size();
+    stats->policy = queue->policy;
+    stats->queued = queue->count;
+    stats->highWater = queue->highWater;
+    stats->dropped = queue->dropped.load();
+    stats->coalesced = queue->coalesced.load();
+    stats->resyncs = queue->resyncs.load();
+    return true;
 }
 
-void SetSendMessageCallback(OnSendMessageDelegate callback) {
-   onSendMessage = callback;
+void SetMidiInputOverflowCallback(OnMidiInputOverflowDelegate callback) {
+    onMidiInputOverflow = callback;
 }
 
-void InitializeMidiLinux() {
-    if (seq_handle == nullptr) {
-        snd_seq_open(&seq_handle, "default", SND_SEQ_OPEN_DUPLEX, 0);
-        snd_seq_set_client_name(seq_handle, "Midi Handler");
-        selfClientId = snd_seq_client_id(seq_handle);
-        selfPortNumber = snd_seq_create_simple_port(seq_handle, "inout",
-            SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ|SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
-            SND_SEQ_PORT_TYPE_APPLICATION);
+void SetMidiLoopbackEnabled(bool enabled) {
+    // attached or detached by the next scan
+    isLoopbackEnabled = enabled;
+}
+
+// listed devices go through the Send API, other sequencer ports are addressed directly
+void sendLatencyProbe(const char* deviceId, unsigned char* probe) {
+    bool isListed;
+    {
+        MidiReadSection section;
+        isListed = findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT) != nullptr;
+    }
+    if (isListed) {
+        SendMidiSystemExclusive(deviceId, probe, MIDI_LATENCY_PROBE_LENGTH);
+        return;
     }
 
-    isStopped = false;
-    std::thread midiConnectionThread(midiConnectionWatcher);
-    midiConnectionThread.detach();
+    MidiDevice device;
+    int client;
+    int port;
+    if (sscanf(deviceId, "seq:%d-%d", &client, &port) != 2) {
+        return;
+    }
+    device.address.client = client;
+    device.address.port = port;
 
-    // input watcher thread
-    std::thread midiInputThread(virtualMidiEventWatcher);
-    midiInputThread.detach();
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_sysex(&ev, MIDI_LATENCY_PROBE_LENGTH, probe);
+    outputSequencerEvent(&device, &ev);
 }
 
-void TerminateMidiLinux() {
-    isStopped = true;
+// log2 microsecond bins
+int latencyHistogramBin(long long nanoseconds) {
+    long long micros = nanoseconds / 1000;
+    int bin = 0;
+    while (micros > 1 && bin < MIDI_LATENCY_HISTOGRAM_BINS - 1) {
+        micros >>= 1;
+        bin++;
+    }
+    return bin;
 }
 
-const char* GetDeviceNameLinux(const char* deviceId) {
-    if (deviceNames.find(deviceId) != deviceNames.end()) {
-        return strdup(deviceNames[deviceId].c_str());
+bool RunMidiLatencyTest(const char* outputDeviceId, const char* inputDeviceId, int probeCount, int intervalMicros, int timeoutMillis, MidiLatencyReport* report) {
+    if (outputDeviceId == nullptr || inputDeviceId == nullptr || report == nullptr || probeCount <= 0 || probeCount > (1 << 28) || intervalMicros < 0) {
+        return false;
+    }
+    std::unique_lock<std::mutex> testLock(latencyTestMutex, std::try_to_lock);
+    if (!testLock.owns_lock()) {
+        return false;
     }
 
-    return NULL;
-}
-
-void SendMidiNoteOff(const char* deviceId, char channel, char note, char velocity) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[3] = {(char)(0x80 | channel), note, velocity};
-            snd_rawmidi_write(it->second, midi, 3);
+    char selfId[32];
+    sprintf(selfId, "seq:%d-%d", selfClientId, selfPortNumber);
+    std::string outputId = strcmp(outputDeviceId, "seq:self") == 0 ? selfId : outputDeviceId;
+    std::string inputId = strcmp(inputDeviceId, "seq:self") == 0 ? selfId : inputDeviceId;
+    bool isOutputSequencer = outputId.compare(0, 4, "seq:") == 0;
+    bool isInputSequencer = inputId.compare(0, 4, "seq:") == 0;
+
+    // devices attach with the next scan, e.g. right after InitializeMidiLinux
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMillis);
+    int inputHandle;
+    while (true) {
+        MidiReadSection section;
+        const MidiDevice* input = findMidiDevice(inputId.c_str(), MIDI_DIRECTION_INPUT);
+        bool outputFound = findMidiDevice(outputId.c_str(), MIDI_DIRECTION_OUTPUT) != nullptr;
+        if ((input != nullptr || isInputSequencer) && (outputFound || isOutputSequencer)) {
+            inputHandle = input != nullptr ? input->handle : 0;
+            break;
         }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
+    MidiLatencyTest test;
+    test.inputHandle = inputHandle;
+    test.inputId = inputId;
+    test.sent.resize(probeCount);
+    test.received.assign(probeCount, 0);
+    test.receivedCount = 0;
+    activeLatencyTest.store(&test);
+
+    unsigned char probe[MIDI_LATENCY_PROBE_LENGTH];
+    for (int i = 0; i < probeCount; i++) {
+        encodeLatencyProbe(i, probe);
+        test.sent[i] = currentTimestamp();
+        sendLatencyProbe(outputId.c_str(), probe);
+        if (intervalMicros > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(intervalMicros));
+        }
+    }
     {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+        std::unique_lock<std::mutex> lock(test.mutex);
+        test.condition.wait_for(lock, std::chrono::milliseconds(timeoutMillis), [&test, probeCount] { return test.receivedCount.load() == probeCount; });
+    }
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+    // late probes are ignored from here, wait for the readers still looking at the test
+    activeLatencyTest.store(nullptr);
+    while (latencyTestUsers.load() != 0) {
+        std::this_thread::yield();
+    }
 
-            snd_seq_ev_set_noteoff(&ev, channel, note, velocity);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
+    std::vector<long long> roundTrips;
+    memset(report, 0, sizeof(MidiLatencyReport));
+    long long jitterSum = 0;
+    for (int i = 0; i < probeCount; i++) {
+        if (test.received[i] == 0) {
+            continue;
+        }
+        long long roundTrip = test.received[i] - test.sent[i];
+        if (!roundTrips.empty()) {
+            long long difference = std::abs(roundTrip - roundTrips.back());
+            jitterSum += difference;
+            report->jitterHistogram[latencyHistogramBin(difference)]++;
         }
+        report->latencyHistogram[latencyHistogramBin(roundTrip)]++;
+        roundTrips.push_back(roundTrip);
+    }
+
+    report->sent = probeCount;
+    report->received = roundTrips.size();
+    if (!roundTrips.empty()) {
+        report->jitter = roundTrips.size() > 1 ? jitterSum / (long long)(roundTrips.size() - 1) : 0;
+        std::sort(roundTrips.begin(), roundTrips.end());
+        report->minimum = roundTrips.front();
+        report->median = roundTrips[roundTrips.size() / 2];
+        // nearest rank
+        report->p99 = roundTrips[(roundTrips.size() * 99 + 99) / 100 - 1];
+        report->maximum = roundTrips.back();
     }
+    return true;
 }
 
-void SendMidiNoteOn(const char* deviceId, char channel, char note, char velocity) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[3] = {(char)(0x90 | channel), note, velocity};
-            snd_rawmidi_write(it->second, midi, 3);
-        }
+bool StartMidiCapture(const char* path) {
+    std::lock_guard<std::mutex> controlLock(captureControlMutex);
+    if (isCapturing) {
+        return false;
+    }
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
     }
+    fwrite(MIDI_CAPTURE_MAGIC, 1, 8, file);
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+    if (captureStages.load() == nullptr) {
+        std::lock_guard<std::mutex> lock(captureStagesMutex);
+        captureStages.store(new MidiCaptureStage[MIDI_CAPTURE_STAGES](), std::memory_order_release);
+    }
+
+    std::lock_guard<std::mutex> lock(midiCapture.mutex);
+    midiCapture.file = file;
+    midiCapture.isStopping = false;
+    midiCapture.deviceHandles.clear();
+    midiCapture.lastTimestamp = 0;
+    unsigned int session = ++captureSession;
+    midiCapture.writer = std::thread(captureWriter, session);
+    isCapturing = true;
+    return true;
+}
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+void StopMidiCapture() {
+    std::lock_guard<std::mutex> controlLock(captureControlMutex);
+    if (!isCapturing) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(midiCapture.mutex);
+        isCapturing = false;
+        midiCapture.isStopping = true;
+        midiCapture.condition.notify_all();
+    }
+    midiCapture.writer.join();
+    fclose(midiCapture.file);
+    midiCapture.file = nullptr;
+}
 
-            snd_seq_ev_set_noteon(&ev, channel, note, velocity);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
-        }
+unsigned int readCaptureInteger(const unsigned char* data, int bytes) {
+    unsigned int value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= data[i] << (8 * i);
     }
+    return value;
 }
 
-void SendMidiPolyphonicAftertouch(const char* deviceId, char channel, char note, char pressure) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[3] = {(char)(0xa0 | channel), note, pressure};
-            snd_rawmidi_write(it->second, midi, 3);
-        }
+// a replayed device, parsed like its live reader would
+struct MidiReplayDevice {
+    MidiParser parser;
+    std::vector<unsigned char> systemExclusiveStream;
+    std::shared_ptr<MidiInputQueue> queue;
+};
+
+bool ReplayMidiCapture(const char* path, double speed) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::vector<unsigned char> capture;
+    unsigned char chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        capture.insert(capture.end(), chunk, chunk + read);
+    }
+    fclose(file);
+    if (capture.size() < 8 || memcmp(capture.data(), MIDI_CAPTURE_MAGIC, 8) != 0) {
+        return false;
     }
 
+    // the messages go to the queues of the captured device ids, and from there to the managed side
+    // without the dispatch thread, only the frame buffer and the subscriptions see them
+    bool isDispatching;
     {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+        std::lock_guard<std::mutex> lock(lifecycleMutex);
+        isDispatching = isInitialized;
+    }
+    std::vector<std::unique_ptr<MidiReplayDevice>> devices;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double elapsedMicros = 0;
+    bool isValid = true;
+
+    size_t offset = 8;
+    while (offset < capture.size()) {
+        const unsigned char* record = capture.data() + offset;
+        size_t remaining = capture.size() - offset;
+        if (record[0] == MIDI_CAPTURE_DEVICE && remaining >= 5) {
+            unsigned int index = readCaptureInteger(record + 1, 2);
+            bool isSequencer = record[3] & MIDI_CAPTURE_SEQUENCER;
+            size_t idLength = record[4];
+            if (remaining < 5 + idLength + 1 || remaining < 6 + idLength + record[5 + idLength] || index != devices.size()) {
+                isValid = false;
+                break;
+            }
+            std::string deviceId((const char*)record + 5, idLength);
+            offset += 6 + idLength + record[5 + idLength];
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+            std::unique_ptr<MidiReplayDevice> device(new MidiReplayDevice());
+            int handle = assignDeviceHandle(deviceId.c_str());
+            if (isDispatching) {
+                device->queue = openInputQueue(deviceId.c_str(), handle, isSequencer);
+            }
+            initializeMidiParser(device->parser, handle, false, device->queue.get());
+            device->systemExclusiveStream.reserve(IO_ARENA_SYSEX_RESERVE);
+            device->parser.systemExclusiveStream = &device->systemExclusiveStream;
+            devices.push_back(std::move(device));
+        } else if (record[0] == MIDI_CAPTURE_BYTES && remaining >= 9) {
+            unsigned int index = readCaptureInteger(record + 1, 2);
+            unsigned int delta = readCaptureInteger(record + 3, 4);
+            size_t length = readCaptureInteger(record + 7, 2);
+            if (remaining < 9 + length || index >= devices.size()) {
+                isValid = false;
+                break;
+            }
+            offset += 9 + length;
 
-            snd_seq_ev_set_keypress(&ev, channel, note, pressure);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
+            if (speed > 0) {
+                elapsedMicros += delta / speed;
+                std::this_thread::sleep_until(start + std::chrono::microseconds((long long)elapsedMicros));
+            }
+            parseMidi(devices[index]->parser, currentTimestamp(), record + 9, length);
+        } else {
+            isValid = false;
+            break;
         }
     }
-}
 
-void SendMidiControlChange(const char* deviceId, char channel, char func, char value) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[3] = {(char)(0xb0 | channel), func, value};
-            snd_rawmidi_write(it->second, midi, 3);
+    for (size_t i = 0; i < devices.size(); i++) {
+        // the dispatch thread delivers what is still queued, then forgets the queue
+        if (devices[i]->queue) {
+            closeInputQueue(devices[i]->queue.get());
         }
     }
+    return isValid;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
-
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+void SetMidiMpeEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(mpeMutex);
+    if (!enabled) {
+        // zones are configured again by the devices
+        mpeStates.clear();
+    }
+    isMpeEnabled = enabled;
+}
 
-            snd_seq_ev_set_controller(&ev, channel, func, value);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
+int GetMidiMpeNoteUpdates(MidiMpeNote* notes, int maxCount) {
+    std::lock_guard<std::mutex> lock(mpeMutex);
+    int count = 0;
+    for (std::map<int, MidiMpeState>::iterator state = mpeStates.begin(); state != mpeStates.end(); ++state) {
+        std::vector<MidiMpeNoteSlot>& slots = state->second.notes;
+        for (std::vector<MidiMpeNoteSlot>::iterator it = slots.begin(); it != slots.end();) {
+            if (it->isDirty && count < maxCount) {
+                notes[count++] = it->note;
+                it->isDirty = false;
+            }
+            if (!it->isDirty && !it->note.isActive) {
+                it = slots.erase(it);
+            } else {
+                ++it;
+            }
         }
     }
+    return count;
 }
 
-void SendMidiProgramChange(const char* deviceId, char channel, char program) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[2] = {(char)(0xc0 | channel), program};
-            snd_rawmidi_write(it->second, midi, 2);
-        }
+bool GetMidiMpeZones(const char* deviceId, int* lowerMembers, int* upperMembers) {
+    int handle = GetDeviceHandleLinux(deviceId);
+    std::lock_guard<std::mutex> lock(mpeMutex);
+    std::map<int, MidiMpeState>::iterator it = mpeStates.find(handle);
+    if (handle == 0 || it == mpeStates.end()) {
+        *lowerMembers = 0;
+        *upperMembers = 0;
+        return handle != 0;
     }
+    *lowerMembers = it->second.lowerMembers;
+    *upperMembers = it->second.upperMembers;
+    return true;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+bool SetMidiBrokerMode(int mode) {
+    if (mode < MIDI_BROKER_OFF || mode > MIDI_BROKER_AUTO) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    brokerMode = mode;
+    return true;
+}
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+int GetMidiBrokerRole() {
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    return brokerRole;
+}
 
-            snd_seq_ev_set_pgmchange(&ev, channel, program);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
+// capacity is rounded up to a power of two, 0 for the default
+// returns the subscription id, 0 on invalid arguments
+int SubscribeMidiEvents(const MidiSubscriptionFilter* filter, int mode, int capacity, OnMidiEventsDelegate callback) {
+    if (filter == nullptr || capacity < 0) {
+        return 0;
+    }
+    if (mode != MIDI_SUBSCRIPTION_RING && (mode != MIDI_SUBSCRIPTION_CALLBACK || callback == nullptr)) {
+        return 0;
+    }
+
+    unsigned int size = 2;
+    while (size < (unsigned int)(capacity == 0 ? MIDI_SUBSCRIPTION_DEFAULT_CAPACITY : capacity) && size < (1u << 24)) {
+        size <<= 1;
+    }
+
+    MidiSubscriber* subscriber = new MidiSubscriber();
+    subscriber->filter = *filter;
+    subscriber->mode = mode;
+    subscriber->callback = callback;
+    subscriber->slots.reset(new MidiSubscriberSlot[size]);
+    for (unsigned int i = 0; i < size; i++) {
+        subscriber->slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    subscriber->mask = size - 1;
+    subscriber->head = 0;
+    subscriber->tail = 0;
+    subscriber->dropped = 0;
+    subscriber->references = 1;
+    subscriber->eventFd = -1;
+    subscriber->waiting = false;
+    subscriber->stopped = false;
+    subscriber->generation = 0;
+    subscriber->workers = 0;
+
+    std::lock_guard<std::mutex> lock(subscribersWriterMutex);
+    subscriber->id = nextSubscriptionId++;
+    if (mode == MIDI_SUBSCRIPTION_CALLBACK) {
+        subscriber->eventFd = eventfd(0, EFD_CLOEXEC);
+        if (subscriber->eventFd < 0) {
+            delete subscriber;
+            return 0;
+        }
+        // otherwise InitializeMidiLinux starts it
+        if (areSubscriberWorkersStarted) {
+            startSubscriberWorker(subscriber);
         }
     }
+
+    MidiSubscriberList* next = new MidiSubscriberList(*subscriberList.load());
+    next->subscribers.push_back(subscriber);
+    publishSubscriberList(next);
+    return subscriber->id;
 }
 
-void SendMidiChannelAftertouch(const char* deviceId, char channel, char pressure) {
+// must not be called while ReadMidiSubscription runs for the same subscription
+void UnsubscribeMidiEvents(int subscription) {
+    MidiSubscriber* subscriber = nullptr;
     {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[2] = {(char)(0xd0 | channel), pressure};
-            snd_rawmidi_write(it->second, midi, 2);
+        std::lock_guard<std::mutex> lock(subscribersWriterMutex);
+        const MidiSubscriberList* current = subscriberList.load();
+        MidiSubscriberList* next = new MidiSubscriberList();
+        for (std::vector<MidiSubscriber*>::const_iterator it = current->subscribers.begin(); it != current->subscribers.end(); ++it) {
+            if ((*it)->id == subscription) {
+                subscriber = *it;
+            } else {
+                next->subscribers.push_back(*it);
+            }
         }
+        if (subscriber == nullptr) {
+            delete next;
+            return;
+        }
+        publishSubscriberList(next);
     }
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
-
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+    // not under the lock, the callback may subscribe or unsubscribe others
+    // the reference of the list is still held, so the subscriber can't go away meanwhile
+    if (subscriber->mode == MIDI_SUBSCRIPTION_CALLBACK) {
+        subscriber->stopped = true;
+        uint64_t wakeup = 1;
+        write(subscriber->eventFd, &wakeup, sizeof(wakeup));
+        // unsubscribing from its own callback, the worker ends when the callback returns
+        if (currentSubscriber != subscriber) {
+            std::unique_lock<std::mutex> threadsLock(midiThreadsMutex);
+            midiThreadsCondition.wait_for(threadsLock, MIDI_THREAD_JOIN_TIMEOUT, [subscriber] { return subscriber->workers == 0; });
+        }
+    }
+    // the I/O threads may still push through the old list, a worker stuck in the callback keeps its own reference
+    retireAfterGracePeriod([subscriber]() { releaseMidiSubscriber(subscriber); });
+    collectRetired();
+}
 
-            snd_seq_ev_set_chanpress(&ev, channel, pressure);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
+// ring mode, from one consumer thread, returns the number of events copied
+int ReadMidiSubscription(int subscription, MidiEvent* events, int maxCount) {
+    MidiReadSection section;
+    const MidiSubscriberList* subscribers = subscriberList.load(std::memory_order_acquire);
+    for (std::vector<MidiSubscriber*>::const_iterator it = subscribers->subscribers.begin(); it != subscribers->subscribers.end(); ++it) {
+        MidiSubscriber* subscriber = *it;
+        if (subscriber->id != subscription || subscriber->mode != MIDI_SUBSCRIPTION_RING) {
+            continue;
         }
+        int count = 0;
+        while (count < maxCount && popSubscriberEvent(subscriber, events[count])) {
+            count++;
+        }
+        return count;
     }
+    return 0;
 }
 
-void SendMidiPitchWheel(const char* deviceId, char channel, short amount) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[3] = {(char)(0xe0 | channel), (char)(amount & 0x7f), (char)((amount >> 7) & 0x7f)};
-            snd_rawmidi_write(it->second, midi, 3);
+// events lost because the subscriber didn't keep up, -1 for an unknown subscription
+long long GetMidiSubscriptionDropped(int subscription) {
+    MidiReadSection section;
+    const MidiSubscriberList* subscribers = subscriberList.load(std::memory_order_acquire);
+    for (std::vector<MidiSubscriber*>::const_iterator it = subscribers->subscribers.begin(); it != subscribers->subscribers.end(); ++it) {
+        if ((*it)->id == subscription) {
+            return (*it)->dropped.load();
         }
     }
+    return -1;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+void SendMidiNoteOff(const char* deviceId, char channel, char note, char velocity) {
+    sendMidiMessage<0x80>(deviceId, channel, note, velocity);
+}
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+void SendMidiNoteOn(const char* deviceId, char channel, char note, char velocity) {
+    sendMidiMessage<0x90>(deviceId, channel, note, velocity);
+}
 
-            snd_seq_ev_set_pitchbend(&ev, channel, amount - 8192);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
-        }
-    }
+void SendMidiPolyphonicAftertouch(const char* deviceId, char channel, char note, char pressure) {
+    sendMidiMessage<0xa0>(deviceId, channel, note, pressure);
 }
 
-void SendMidiSystemExclusive(const char* deviceId, unsigned char* data, int length) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            snd_rawmidi_write(it->second, data, length);
-        }
-    }
+void SendMidiControlChange(const char* deviceId, char channel, char func, char value) {
+    sendMidiMessage<0xb0>(deviceId, channel, func, value);
+}
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+void SendMidiProgramChange(const char* deviceId, char channel, char program) {
+    sendMidiMessage<0xc0>(deviceId, channel, program, 0);
+}
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+void SendMidiChannelAftertouch(const char* deviceId, char channel, char pressure) {
+    sendMidiMessage<0xd0>(deviceId, channel, pressure, 0);
+}
 
-            snd_seq_ev_set_sysex(&ev, length, data);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
-        }
+void SendMidiPitchWheel(const char* deviceId, char channel, short amount) {
+    sendMidiMessage<0xe0>(deviceId, channel, amount & 0x7f, (amount >> 7) & 0x7f);
+}
+
+void SendMidiSystemExclusive(const char* deviceId, unsigned char* data, int length) {
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT);
+    if (device == nullptr) {
+        return;
+    }
+
+    if (device->output) {
+        writeMidiOutput(device, data, length);
+    } else {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_sysex(&ev, length, data);
+        outputSequencerEvent(device, &ev);
     }
 }
 
 void SendMidiTimeCodeQuarterFrame(const char* deviceId, char value) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[2] = {(char)0xf1, value};
-        snd_rawmidi_write(it->second, midi, 2);
-    }
+    sendMidiMessage<0xf1>(deviceId, 0, value, 0);
 }
 
 void SendMidiSongPositionPointer(const char* deviceId, short position) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[3] = {(char)0xf2, (char)(position & 0x7f), (char)((position >> 7) & 0x7f)};
-        snd_rawmidi_write(it->second, midi, 3);
-    }
+    sendMidiMessage<0xf2>(deviceId, 0, position & 0x7f, (position >> 7) & 0x7f);
 }
 
 void SendMidiSongSelect(const char* deviceId, char song) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[2] = {(char)0xf3, song};
-        snd_rawmidi_write(it->second, midi, 2);
-    }
+    sendMidiMessage<0xf3>(deviceId, 0, song, 0);
 }
 
 void SendMidiTuneRequest(const char* deviceId) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[1] = {(char)0xf6};
-        snd_rawmidi_write(it->second, midi, 1);
-    }
+    sendMidiMessage<0xf6>(deviceId, 0, 0, 0);
 }
 
 void SendMidiTimingClock(const char* deviceId) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[1] = {(char)0xf8};
-        snd_rawmidi_write(it->second, midi, 1);
-    }
+    sendMidiMessage<0xf8>(deviceId, 0, 0, 0);
 }
 
 void SendMidiStart(const char* deviceId) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[1] = {(char)0xfa};
-            snd_rawmidi_write(it->second, midi, 1);
-        }
+    sendMidiMessage<0xfa>(deviceId, 0, 0, 0);
+}
+
+void SendMidiContinue(const char* deviceId) {
+    sendMidiMessage<0xfb>(deviceId, 0, 0, 0);
+}
+
+void SendMidiStop(const char* deviceId) {
+    sendMidiMessage<0xfc>(deviceId, 0, 0, 0);
+}
+
+void SendMidiActiveSensing(const char* deviceId) {
+    sendMidiMessage<0xfe>(deviceId, 0, 0, 0);
+}
+
+void SendMidiReset(const char* deviceId) {
+    sendMidiMessage<0xff>(deviceId, 0, 0, 0);
+}
+
+// UMP endpoints receive the packets as they are, MIDI 1.0 devices the translated messages
+void SendUmpPacket(const char* deviceId, const unsigned int* words, int wordCount) {
+    MidiReadSection section;
+    const MidiDevice* device = findMidiDevice(deviceId, MIDI_DIRECTION_OUTPUT);
+    if (device == nullptr) {
+        return;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+#ifdef MIDI_UMP_SUPPORTED
+    if (device->output && device->output->ump != nullptr) {
+        MidiOutputWriterFlush flush(device);
+        std::lock_guard<std::mutex> lock(device->output->mutex);
+        if (device->output->ump != nullptr) {
+            snd_ump_write(device->output->ump, words, wordCount * sizeof(unsigned int));
+        }
+        return;
+    }
+#endif
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+    unsigned char bytes[16];
+    int offset = 0;
+    while (offset < wordCount) {
+        int packetWords = UMP_PACKET_WORDS[UMP_MESSAGE_TYPE(words[offset])];
+        if (offset + packetWords > wordCount) {
+            break;
+        }
 
-            snd_seq_ev_set_queue_start(&ev, SND_SEQ_QUEUE_DIRECT);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
+        int length = translateUmpToMidi1(words + offset, bytes);
+        if (length > 0) {
+            if (device->output) {
+                writeMidiOutput(device, bytes, length);
+            } else {
+                outputSequencerBytes(device, bytes, length);
+            }
         }
+        offset += packetWords;
     }
 }
 
-void SendMidiContinue(const char* deviceId) {
-    {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[1] = {(char)0xfb};
-            snd_rawmidi_write(it->second, midi, 1);
+bool CreateMidiOutputGroup(const char* groupName, const char** deviceIds, int count) {
+    if (groupName == nullptr || count < 0) {
+        return false;
+    }
+    std::shared_ptr<MidiOutputGroup> group = std::make_shared<MidiOutputGroup>();
+    for (int i = 0; i < count; i++) {
+        if (std::find(group->deviceIds.begin(), group->deviceIds.end(), deviceIds[i]) == group->deviceIds.end()) {
+            group->deviceIds.push_back(deviceIds[i]);
         }
     }
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
-
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+    // the lifecycle first, as InitializeMidiLinux takes them
+    std::lock_guard<std::mutex> lifecycleLock(lifecycleMutex);
+    std::lock_guard<std::mutex> lock(outputGroupsMutex);
+    decltype(outputGroups)::iterator it = outputGroups.find(groupName);
+    if (it != outputGroups.end()) {
+        // replaced, keeping its mode
+        std::lock_guard<std::mutex> groupLock(it->second->mutex);
+        group->parallel = it->second->parallel;
+    }
+    openGroupWriters(group.get());
+    outputGroups[groupName] = group;
+    closeUnusedOutputWriters();
+    return true;
+}
 
-            snd_seq_ev_set_queue_continue(&ev, SND_SEQ_QUEUE_DIRECT);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
-        }
+void DestroyMidiOutputGroup(const char* groupName) {
+    std::lock_guard<std::mutex> lifecycleLock(lifecycleMutex);
+    std::lock_guard<std::mutex> lock(outputGroupsMutex);
+    decltype(outputGroups)::iterator it = outputGroups.find(groupName);
+    if (it != outputGroups.end()) {
+        outputGroups.erase(it);
+        closeUnusedOutputWriters();
     }
 }
 
-void SendMidiStop(const char* deviceId) {
+bool SetMidiOutputGroupParallel(const char* groupName, bool parallel) {
+    std::lock_guard<std::mutex> lifecycleLock(lifecycleMutex);
+    std::lock_guard<std::mutex> lock(outputGroupsMutex);
+    decltype(outputGroups)::iterator it = outputGroups.find(groupName);
+    if (it == outputGroups.end()) {
+        return false;
+    }
+    MidiOutputGroup* group = it->second.get();
     {
-        std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-        decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-        if (it != midiOutputMap.end()) {
-            char midi[1] = {(char)0xfc};
-            snd_rawmidi_write(it->second, midi, 1);
-        }
+        std::lock_guard<std::mutex> groupLock(group->mutex);
+        group->parallel = parallel;
+        group->resolved.reset();
+        openGroupWriters(group);
     }
+    closeUnusedOutputWriters();
+    return true;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(virtualMidiOutputMapMutex);
-        decltype(virtualMidiOutputMap)::iterator it2 = virtualMidiOutputMap.find(deviceId);
-        if (it2 != virtualMidiOutputMap.end() && seq_handle != nullptr) {
-            snd_seq_event_t ev;
-            snd_seq_ev_clear(&ev);
-            snd_seq_ev_set_direct(&ev);
+void SendMidiGroupNoteOff(const char* groupName, char channel, char note, char velocity) {
+    sendGroupMidiMessage<0x80>(groupName, channel, note, velocity);
+}
 
-            snd_seq_ev_set_dest(&ev, it2->second.client, it2->second.port);
+void SendMidiGroupNoteOn(const char* groupName, char channel, char note, char velocity) {
+    sendGroupMidiMessage<0x90>(groupName, channel, note, velocity);
+}
 
-            snd_seq_ev_set_queue_stop(&ev, SND_SEQ_QUEUE_DIRECT);
-            snd_seq_event_output(seq_handle, &ev);
-            snd_seq_drain_output(seq_handle);
-        }
+void SendMidiGroupPolyphonicAftertouch(const char* groupName, char channel, char note, char pressure) {
+    sendGroupMidiMessage<0xa0>(groupName, channel, note, pressure);
+}
+
+void SendMidiGroupControlChange(const char* groupName, char channel, char func, char value) {
+    sendGroupMidiMessage<0xb0>(groupName, channel, func, value);
+}
+
+void SendMidiGroupProgramChange(const char* groupName, char channel, char program) {
+    sendGroupMidiMessage<0xc0>(groupName, channel, program, 0);
+}
+
+void SendMidiGroupChannelAftertouch(const char* groupName, char channel, char pressure) {
+    sendGroupMidiMessage<0xd0>(groupName, channel, pressure, 0);
+}
+
+void SendMidiGroupPitchWheel(const char* groupName, char channel, short amount) {
+    sendGroupMidiMessage<0xe0>(groupName, channel, amount & 0x7f, (amount >> 7) & 0x7f);
+}
+
+void SendMidiGroupSystemExclusive(const char* groupName, unsigned char* data, int length) {
+    if (length > 0) {
+        sendGroupMessage(groupName, data, length);
     }
 }
 
-void SendMidiActiveSensing(const char* deviceId) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[1] = {(char)0xfe};
-        snd_rawmidi_write(it->second, midi, 1);
+void SendMidiGroupTimeCodeQuarterFrame(const char* groupName, char value) {
+    sendGroupMidiMessage<0xf1>(groupName, 0, value, 0);
+}
+
+void SendMidiGroupSongPositionPointer(const char* groupName, short position) {
+    sendGroupMidiMessage<0xf2>(groupName, 0, position & 0x7f, (position >> 7) & 0x7f);
+}
+
+void SendMidiGroupSongSelect(const char* groupName, char song) {
+    sendGroupMidiMessage<0xf3>(groupName, 0, song, 0);
+}
+
+void SendMidiGroupTuneRequest(const char* groupName) {
+    sendGroupMidiMessage<0xf6>(groupName, 0, 0, 0);
+}
+
+void SendMidiGroupTimingClock(const char* groupName) {
+    sendGroupMidiMessage<0xf8>(groupName, 0, 0, 0);
+}
+
+void SendMidiGroupStart(const char* groupName) {
+    sendGroupMidiMessage<0xfa>(groupName, 0, 0, 0);
+}
+
+void SendMidiGroupContinue(const char* groupName) {
+    sendGroupMidiMessage<0xfb>(groupName, 0, 0, 0);
+}
+
+void SendMidiGroupStop(const char* groupName) {
+    sendGroupMidiMessage<0xfc>(groupName, 0, 0, 0);
+}
+
+void SendMidiGroupActiveSensing(const char* groupName) {
+    sendGroupMidiMessage<0xfe>(groupName, 0, 0, 0);
+}
+
+void SendMidiGroupReset(const char* groupName) {
+    sendGroupMidiMessage<0xff>(groupName, 0, 0, 0);
+}
+
+#ifdef MIDI_LATENCY_TOOL
+// command line front end of RunMidiLatencyTest, built by build.sh as midi-latency
+void printLatencyHistogram(const char* title, const int* histogram) {
+    printf("%s\n", title);
+    for (int i = 0; i < MIDI_LATENCY_HISTOGRAM_BINS; i++) {
+        if (histogram[i] > 0) {
+            printf("  %8lld us %8d\n", i == 0 ? 0 : 1LL << i, histogram[i]);
+        }
     }
 }
 
-void SendMidiReset(const char* deviceId) {
-    std::lock_guard<std::mutex> lock(midiOutputMapMutex);
-    decltype(midiOutputMap)::iterator it = midiOutputMap.find(deviceId);
-    if (it != midiOutputMap.end()) {
-        char midi[1] = {(char)0xff};
-        snd_rawmidi_write(it->second, midi, 1);
+int main(int argc, char** argv) {
+    const char* output = "seq:self";
+    const char* input = nullptr;
+    int count = 1000;
+    int interval = 1000;
+    int timeout = 2000;
+    bool loopback = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input = argv[++i];
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--loopback") == 0) {
+            loopback = true;
+            output = MIDI_LOOPBACK_ID;
+        } else {
+            fprintf(stderr, "usage: %s [--output ID] [--input ID] [--count N] [--interval US] [--timeout MS] [--loopback]\n", argv[0]);
+            fprintf(stderr, "  the input defaults to the output, seq:self is the tool's own sequencer port\n");
+            fprintf(stderr, "  --loopback only checks the probe path in-process, its times are call overhead\n");
+            return 2;
+        }
+    }
+    if (input == nullptr) {
+        input = output;
+    }
+
+    SetMidiLoopbackEnabled(loopback);
+    InitializeMidiLinux();
+
+    MidiLatencyReport report;
+    bool completed = RunMidiLatencyTest(output, input, count, interval, timeout, &report);
+    TerminateMidiLinux();
+    if (!completed) {
+        fprintf(stderr, "%s -> %s: devices not found\n", output, input);
+        return 1;
+    }
+
+    printf("%s -> %s%s\n", output, input, loopback ? " (self-test, the times are call overhead)" : "");
+    printf("received %d / %d\n", report.received, report.sent);
+    if (report.received > 0) {
+        printf("min %.1f us, median %.1f us, p99 %.1f us, max %.1f us, jitter %.1f us\n",
+            report.minimum / 1000.0, report.median / 1000.0, report.p99 / 1000.0, report.maximum / 1000.0, report.jitter / 1000.0);
+        printLatencyHistogram("round trip", report.latencyHistogram);
+        printLatencyHistogram("jitter", report.jitterHistogram);
     }
+    return report.received == report.sent ? 0 : 1;
 }
+#endif